@@ -0,0 +1,184 @@
+// Packs sprite files into one atlas for def::SpriteAtlas
+//
+//   AtlasPacker [--compress] [--bench] out.atlas a.spr b.spr ...
+//
+// Each sprite is stored under its path as given on the command line.
+// --bench then times loading the sprites from their own files against
+// opening the atlas and getting every sprite, stored and compressed
+
+#include <iostream>
+#include <iomanip>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+
+#include "ConsoleGameEngine.h"
+
+using namespace def;
+
+static std::wstring Widen(const std::string& s)
+{
+	return std::wstring(s.begin(), s.end());
+}
+
+// Runs fn once to warm the page cache, then times nRuns more and prints
+// the fastest and slowest. False if any run failed
+static bool Time(const char* sWhat, int32_t nRuns, const std::function<bool()>& fn)
+{
+	if (!fn())
+	{
+		std::cerr << sWhat << ": failed\n";
+		return false;
+	}
+
+	double dMin = 0.0, dMax = 0.0;
+
+	for (int32_t r = 0; r < nRuns; r++)
+	{
+		auto tStart = std::chrono::steady_clock::now();
+
+		if (!fn())
+		{
+			std::cerr << sWhat << ": failed\n";
+			return false;
+		}
+
+		double dUs = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - tStart).count();
+
+		dMin = r == 0 ? dUs : std::min(dMin, dUs);
+		dMax = std::max(dMax, dUs);
+	}
+
+	std::cout << "  " << std::left << std::setw(40) << sWhat << std::right << std::fixed << std::setprecision(1)
+		<< std::setw(9) << dMin << " - " << dMax << " us\n";
+
+	return true;
+}
+
+// Writes the atlas both ways, the one asked for last so it's what's left
+static int Bench(const std::string& sAtlas, const std::vector<std::string>& vecFiles,
+	const std::vector<std::pair<std::string, const Sprite*>>& vecSprites, bool bCompress)
+{
+	const int32_t nRuns = 20;
+
+	std::cout << "Best and worst of " << nRuns << " runs, " << vecFiles.size() << " sprites:\n";
+
+	bool bOk = Time("per-file Sprite::Load of all", nRuns, [&]()
+	{
+		std::vector<Sprite> vecLoaded(vecFiles.size());
+
+		for (size_t i = 0; i < vecFiles.size(); i++)
+			if (!vecLoaded[i].Load(Widen(vecFiles[i])))
+				return false;
+
+		return true;
+	});
+
+	for (bool bCompressed : { !bCompress, bCompress })
+	{
+		if (!bOk || !SpriteAtlas::Write(Widen(sAtlas), vecSprites, bCompressed).ok)
+			return 1;
+
+		std::string sOpen = bCompressed ? "compressed atlas Open()" : "stored atlas Open()";
+		std::string sGet = sOpen + " + Get() of all";
+
+		bOk = Time(sOpen.c_str(), nRuns, [&]()
+		{
+			SpriteAtlas atlas;
+			return atlas.Open(Widen(sAtlas)).ok;
+		});
+
+		bOk = bOk && Time(sGet.c_str(), nRuns, [&]()
+		{
+			SpriteAtlas atlas;
+
+			if (!atlas.Open(Widen(sAtlas)).ok)
+				return false;
+
+			for (int32_t n = 0; n < atlas.GetCount(); n++)
+				if (!atlas.Get(n).pCells)
+					return false;
+
+			return true;
+		});
+	}
+
+	return bOk ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+	bool bCompress = false;
+	bool bBench = false;
+	std::vector<std::string> vecArgs;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--compress") == 0)
+			bCompress = true;
+		else if (strcmp(argv[i], "--bench") == 0)
+			bBench = true;
+		else
+			vecArgs.push_back(argv[i]);
+	}
+
+	if (vecArgs.size() < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " [--compress] [--bench] out.atlas a.spr b.spr ...\n";
+		return 1;
+	}
+
+	std::vector<std::unique_ptr<Sprite>> vecLoaded;
+	std::vector<std::pair<std::string, const Sprite*>> vecSprites;
+
+	size_t nRawBytes = 0;
+
+	for (size_t i = 1; i < vecArgs.size(); i++)
+	{
+		vecLoaded.push_back(std::make_unique<Sprite>());
+
+		if (!vecLoaded.back()->Load(Widen(vecArgs[i])))
+		{
+			std::cerr << vecArgs[i] << ": not a sprite file\n";
+			return 1;
+		}
+
+		vecSprites.push_back({ vecArgs[i], vecLoaded.back().get() });
+		nRawBytes += (size_t)vecLoaded.back()->nWidth * vecLoaded.back()->nHeight * sizeof(CHAR_INFO);
+	}
+
+	rcode rc = SpriteAtlas::Write(Widen(vecArgs[0]), vecSprites, bCompress);
+
+	if (!rc.ok)
+	{
+		std::cerr << vecArgs[0] << ": " << rc.info << "\n";
+		return 1;
+	}
+
+	SpriteAtlas atlas;
+	rc = atlas.Open(Widen(vecArgs[0]));
+
+	if (!rc.ok)
+	{
+		std::cerr << vecArgs[0] << ": " << rc.info << "\n";
+		return 1;
+	}
+
+	FILE* f = fopen(vecArgs[0].c_str(), "rb");
+	fseek(f, 0, SEEK_END);
+	long nFileBytes = ftell(f);
+	fclose(f);
+
+	std::cout << "Packed " << atlas.GetCount() << " sprites, " << nRawBytes << " bytes of cells into "
+		<< nFileBytes << " bytes\n";
+
+	if (bBench)
+	{
+		atlas.Close();
+		return Bench(vecArgs[0], std::vector<std::string>(vecArgs.begin() + 1, vecArgs.end()), vecSprites, bCompress);
+	}
+
+	return 0;
+}
@@ -80,14 +80,13 @@
 **/
 #pragma endregion
 
-#ifndef UNICODE
+#if defined(_WIN32) && !defined(UNICODE)
 #error Enable Unicode in settings
 #endif
 
 #define _CRT_SECURE_NO_WARNINGS
 
 #include <iostream>
-#include <Windows.h>
 #include <vector>
 #include <chrono>
 #include <cmath>
@@ -96,7 +95,19 @@
 #include <thread>
 #include <string>
 #include <list>
+#include <map>
+#include <atomic>
 #include <cstdint>
+#include <cstring>
+#include <memory>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DEF_CGE_SSE2
+#include <immintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <Windows.h>
 
 #pragma comment(lib, "winmm.lib")
 
@@ -104,6 +115,55 @@
 #include <Xinput.h>
 #pragma comment(lib, "XInput.lib")
 #endif
+#else
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cwchar>
+
+// The subset of Win32 the engine's interface exposes
+struct CHAR_INFO
+{
+	union
+	{
+		uint16_t UnicodeChar;
+		char AsciiChar;
+	} Char;
+
+	uint16_t Attributes;
+};
+
+struct SMALL_RECT
+{
+	int16_t Left;
+	int16_t Top;
+	int16_t Right;
+	int16_t Bottom;
+};
+
+enum : int16_t
+{
+	VK_BACK = 0x08,
+	VK_TAB = 0x09,
+	VK_RETURN = 0x0D,
+	VK_ESCAPE = 0x1B,
+	VK_SPACE = 0x20,
+	VK_LEFT = 0x25,
+	VK_UP = 0x26,
+	VK_RIGHT = 0x27,
+	VK_DOWN = 0x28,
+	VK_DELETE = 0x2E,
+	VK_F1 = 0x70,
+	VK_F2, VK_F3, VK_F4, VK_F5, VK_F6,
+	VK_F7, VK_F8, VK_F9, VK_F10, VK_F11, VK_F12
+};
+
+#define swprintf_s swprintf
+#endif
 
 namespace def
 {
@@ -298,6 +358,45 @@ namespace def
 
 	const float PI = 2.0f * acosf(0.0f);
 
+	// Outline vertices for DrawWireFrameModel, xs and ys in separate
+	// arrays so the transform can take 4 of each at a time
+	struct WireFrameModel
+	{
+		std::vector<float> vecX;
+		std::vector<float> vecY;
+
+		WireFrameModel() = default;
+
+		WireFrameModel(const std::vector<std::pair<float, float>>& vecCoordinates)
+		{
+			vecX.reserve(vecCoordinates.size());
+			vecY.reserve(vecCoordinates.size());
+
+			for (const auto& p : vecCoordinates)
+				Add(p.first, p.second);
+		}
+
+		void Add(float x, float y)
+		{
+			vecX.push_back(x);
+			vecY.push_back(y);
+		}
+
+		size_t Size() const { return vecX.size(); }
+	};
+
+	// Read-only cells laid out like a Sprite's, wherever they live
+	struct SpriteView
+	{
+		const CHAR_INFO* pCells = nullptr;
+		int32_t nWidth = 0;
+		int32_t nHeight = 0;
+		bool bOpaque = false; // no ' ' glyphs, rows can be copied outright
+	};
+
+	// Glyph and colour interleaved as CHAR_INFO, row-major, so a sprite
+	// row has the screen's layout and can be blitted a row at a time.
+	// Owns its cells: copies are deep, moves steal them
 	class Sprite
 	{
 	public:
@@ -317,73 +416,146 @@ namespace def
 				Create(8, 8);
 		}
 
+		Sprite(const Sprite&) = default;
+		Sprite& operator=(const Sprite&) = default;
+
+		Sprite(Sprite&& other) noexcept
+		{
+			*this = std::move(other);
+		}
+
+		Sprite& operator=(Sprite&& other) noexcept
+		{
+			if (this != &other)
+			{
+				vecCells = std::move(other.vecCells);
+				nWidth = other.nWidth;
+				nHeight = other.nHeight;
+				nTransparent = other.nTransparent;
+
+				// Leave it a valid empty sprite
+				other.vecCells.clear();
+				other.nWidth = 0;
+				other.nHeight = 0;
+				other.nTransparent = 0;
+			}
+
+			return *this;
+		}
+
 	private:
-		int16_t* m_Glyphs = nullptr;
-		int16_t* m_Colours = nullptr;
+		std::vector<CHAR_INFO> vecCells;
+		int32_t nTransparent = 0; // cells with a ' ' glyph, 0 lets rows be copied outright
 
 	public:
 		int32_t nWidth = 0;
 		int32_t nHeight = 0;
 
 	private:
-		void Create(int w, int h)
+		void Create(int32_t w, int32_t h)
 		{
-			nWidth = w;
-			nHeight = h;
+			nWidth = std::max(w, 0);
+			nHeight = std::max(h, 0);
 
-			m_Glyphs = new int16_t[w * h];
-			m_Colours = new int16_t[w * h];
+			CHAR_INFO blank;
+			blank.Char.UnicodeChar = L' ';
+			blank.Attributes = FG_BLACK;
 
-			for (int i = 0; i < w * h; i++)
-			{
-				m_Glyphs[i] = L' ';
-				m_Colours[i] = FG_BLACK;
-			}
+			vecCells.assign(nWidth * nHeight, blank);
+			nTransparent = nWidth * nHeight;
+		}
+
+		bool Contains(int32_t x, int32_t y) const
+		{
+			return x >= 0 && x < nWidth && y >= 0 && y < nHeight;
 		}
 
 	public:
 		void SetGlyph(int32_t x, int32_t y, int16_t c)
 		{
-			if (x > 0 || x < nWidth || y > 0 || y < nHeight)
-				m_Glyphs[y * nWidth + x] = c;
+			if (!Contains(x, y))
+				return;
+
+			CHAR_INFO& cell = vecCells[y * nWidth + x];
+			nTransparent += (c == L' ') - (cell.Char.UnicodeChar == L' ');
+			cell.Char.UnicodeChar = c;
 		}
 
 		void SetColour(int32_t x, int32_t y, int16_t c)
 		{
-			if (x > 0 || x < nWidth || y > 0 || y < nHeight)
-				m_Colours[y * nWidth + x] = c;
+			if (Contains(x, y))
+				vecCells[y * nWidth + x].Attributes = c;
 		}
 
-		int16_t GetGlyph(int32_t x, int32_t y)
+		int16_t GetGlyph(int32_t x, int32_t y) const
 		{
-			if (x > 0 || x < nWidth || y > 0 || y < nHeight)
-				return m_Glyphs[y * nWidth + x];
+			if (Contains(x, y))
+				return vecCells[y * nWidth + x].Char.UnicodeChar;
 
 			return L' ';
 		}
 
-		int16_t GetColour(int32_t x, int32_t y)
+		int16_t GetColour(int32_t x, int32_t y) const
 		{
-			if (x > 0 || x < nWidth || y > 0 || y < nHeight)
-				return m_Colours[y * nWidth + x];
+			if (Contains(x, y))
+				return vecCells[y * nWidth + x].Attributes;
 
 			return FG_BLACK;
 		}
 
-		bool Save(std::wstring sFile)
+		// nWidth cells, nullptr past the last row
+		const CHAR_INFO* GetRow(int32_t y) const
+		{
+			return y >= 0 && y < nHeight ? &vecCells[y * nWidth] : nullptr;
+		}
+
+		bool IsOpaque() const
+		{
+			return nTransparent == 0;
+		}
+
+		SpriteView GetView() const
+		{
+			return { vecCells.data(), nWidth, nHeight, IsOpaque() };
+		}
+
+		static FILE* OpenFile(const std::wstring& sFile, bool bWrite)
 		{
+#ifdef _WIN32
 			FILE* f = nullptr;
+			_wfopen_s(&f, sFile.c_str(), bWrite ? L"wb" : L"rb");
+			return f;
+#else
+			std::string sPath;
+			for (wchar_t c : sFile)
+				sPath += (char)c;
+
+			return std::fopen(sPath.c_str(), bWrite ? "wb" : "rb");
+#endif
+		}
 
-			_wfopen_s(&f, sFile.c_str(), L"wb");
+		// The file keeps the old planar layout: all colours, then all glyphs
+		bool Save(std::wstring sFile) const
+		{
+			FILE* f = OpenFile(sFile, true);
 
 			if (f == nullptr)
 				return false;
 
+			std::vector<int16_t> vecPlane(vecCells.size());
+
 			fwrite(&nWidth, sizeof(int32_t), 1, f);
 			fwrite(&nHeight, sizeof(int32_t), 1, f);
 
-			fwrite(m_Colours, sizeof(int16_t), nWidth * nHeight, f);
-			fwrite(m_Glyphs, sizeof(int16_t), nWidth * nHeight, f);
+			for (size_t i = 0; i < vecCells.size(); i++)
+				vecPlane[i] = vecCells[i].Attributes;
+
+			fwrite(vecPlane.data(), sizeof(int16_t), vecPlane.size(), f);
+
+			for (size_t i = 0; i < vecCells.size(); i++)
+				vecPlane[i] = vecCells[i].Char.UnicodeChar;
+
+			fwrite(vecPlane.data(), sizeof(int16_t), vecPlane.size(), f);
 
 			fclose(f);
 
@@ -392,240 +564,2516 @@ namespace def
 
 		bool Load(std::wstring sFile)
 		{
-			delete[] m_Glyphs;
-			delete[] m_Colours;
-
-			nWidth = 0;
-			nHeight = 0;
+			Create(0, 0);
 
-			FILE* f = nullptr;
-
-			_wfopen_s(&f, sFile.c_str(), L"rb");
+			FILE* f = OpenFile(sFile, false);
 
 			if (f == nullptr)
 				return false;
 
-			std::fread(&nWidth, sizeof(int32_t), 1, f);
-			std::fread(&nHeight, sizeof(int32_t), 1, f);
+			int32_t w = 0, h = 0;
+
+			if (std::fread(&w, sizeof(int32_t), 1, f) != 1 || std::fread(&h, sizeof(int32_t), 1, f) != 1 ||
+				w <= 0 || h <= 0 || w > 0x8000 || h > 0x8000)
+			{
+				std::fclose(f);
+				return false;
+			}
 
-			Create(nWidth, nHeight);
+			std::vector<int16_t> vecColours(w * h);
+			std::vector<int16_t> vecGlyphs(w * h);
 
-			std::fread(m_Colours, sizeof(int16_t), nWidth * nHeight, f);
-			std::fread(m_Glyphs, sizeof(int16_t), nWidth * nHeight, f);
+			bool bRead = std::fread(vecColours.data(), sizeof(int16_t), vecColours.size(), f) == vecColours.size() &&
+				std::fread(vecGlyphs.data(), sizeof(int16_t), vecGlyphs.size(), f) == vecGlyphs.size();
 
 			std::fclose(f);
 
+			if (!bRead)
+				return false;
+
+			Create(w, h);
+
+			for (size_t i = 0; i < vecCells.size(); i++)
+			{
+				vecCells[i].Char.UnicodeChar = vecGlyphs[i];
+				vecCells[i].Attributes = vecColours[i];
+			}
+
+			nTransparent = (int32_t)std::count(vecGlyphs.begin(), vecGlyphs.end(), int16_t(L' '));
+
 			return true;
 		}
 	};
 
-	class ConsoleGameEngine
+	// Many sprites in one file that is mapped rather than read. Stored
+	// sprites are drawn straight from the mapping, LZ-compressed ones are
+	// decoded the first time they're asked for.
+	//
+	// Layout, little-endian: Header, one Entry per sprite sorted by name,
+	// the names, then each sprite's CHAR_INFO cells (4-byte aligned) or
+	// their compressed bytes
+	class SpriteAtlas
 	{
 	public:
-		ConsoleGameEngine()
+		SpriteAtlas() = default;
+		SpriteAtlas(const SpriteAtlas&) = delete;
+		SpriteAtlas& operator=(const SpriteAtlas&) = delete;
+
+		~SpriteAtlas()
 		{
-			hConsoleOut = GetStdHandle(STD_OUTPUT_HANDLE);
-			hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+			Close();
+		}
 
-			hWnd = GetConsoleWindow();
+		rcode Open(const std::wstring& sFile);
+		void Close();
 
-			hDC = GetDC(hWnd);
+		int32_t GetCount() const { return nSprites; }
 
-			sAppName = L"Undefined";
-			sFont = L"Consolas";
-		}
+		// Binary search on the sorted index, -1 if there's no such sprite
+		int32_t Find(const std::string& sName) const;
+		std::string GetName(int32_t nSprite) const;
 
-		virtual ~ConsoleGameEngine()
-		{
-			delete[] screen;
-		}
+		// Empty if nSprite is out of range or its data doesn't decode
+		SpriteView Get(int32_t nSprite);
 
-	public:
-		virtual bool OnUserCreate() = 0;
-		virtual bool OnUserUpdate(float fDeltaTime) = 0;
+		// Packs the sprites under their names. With bCompress each one is
+		// stored compressed if that makes it smaller
+		static rcode Write(const std::wstring& sFile, std::vector<std::pair<std::string, const Sprite*>> vecSprites, bool bCompress);
 
-		rcode ConstructConsole(int width = 120, int height = 40, int fontw = 4, int fonth = 4)
+		// LZ4-style blocks: a token (literal count << 4 | match length - 4,
+		// a nibble at 15 continues in 255-saturated bytes), the literals,
+		// then a 16-bit offset back into the output. The last sequence has
+		// literals only
+		static void Compress(const uint8_t* pSrc, size_t nSize, std::vector<uint8_t>& vecOut);
+		static bool Decompress(const uint8_t* pSrc, size_t nSrcSize, uint8_t* pDst, size_t nDstSize);
+
+	private:
+		struct Header
 		{
-			rcode rc;
-			rc.ok = false;
+			char sMagic[4];
+			uint32_t nVersion;
+			uint32_t nSprites;
+			uint32_t nReserved;
+		};
 
-			if (width <= 0 || height <= 0 || fontw <= 0 || fonth <= 0)
-			{
-				rc.info = "Invalid width or height";
-				return rc;
-			}
+		struct Entry
+		{
+			uint32_t nNameOffset;
+			uint32_t nNameLength;
+			int32_t nWidth;
+			int32_t nHeight;
+			uint32_t nDataOffset;
+			uint32_t nDataSize;
+			uint32_t nFlags;
+			uint32_t nReserved;
+		};
 
-			nScreenWidth = width;
-			nScreenHeight = height;
+		static const uint32_t nVersion = 1;
+		static const uint32_t nFlagCompressed = 1;
+		static const uint32_t nFlagOpaque = 2;
 
-			nFontW = fontw;
-			nFontH = fonth;
+		const uint8_t* pData = nullptr;
+		size_t nSize = 0;
 
-			hConsoleOut = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
+#ifdef _WIN32
+		HANDLE hFile = INVALID_HANDLE_VALUE;
+		HANDLE hMapping = nullptr;
+#endif
 
-			if (hConsoleOut == INVALID_HANDLE_VALUE)
-			{
-				rc.info = "Can't create console screen buffer for output";
-				return rc;
-			}
+		const Entry* pEntries = nullptr;
+		int32_t nSprites = 0;
 
-			rectWindow = { 0, 0, 1, 1 };
-			SetConsoleWindowInfo(hConsoleOut, TRUE, &rectWindow);
+		// Decoded cells of compressed sprites, empty until first use
+		std::vector<std::vector<CHAR_INFO>> vecDecoded;
+	};
 
-			COORD coord = { (int16_t)nScreenWidth, (int16_t)nScreenHeight };
-			if (!SetConsoleScreenBufferSize(hConsoleOut, coord))
-			{
-				rc.info = "Too large or to small screen width or height";
-				return rc;
-			}
+	rcode SpriteAtlas::Open(const std::wstring& sFile)
+	{
+		Close();
 
-			if (!SetConsoleActiveScreenBuffer(hConsoleOut))
-			{
-				rc.info = "Can't set console screen buffer";
-				return rc;
-			}
+#ifdef _WIN32
+		hFile = CreateFileW(sFile.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
 
-			CONSOLE_FONT_INFOEX cfi;
-			cfi.cbSize = sizeof(cfi);
-			cfi.nFont = 0;
-			cfi.dwFontSize.X = nFontW;
-			cfi.dwFontSize.Y = nFontH;
-			cfi.FontFamily = FF_DONTCARE;
-			cfi.FontWeight = FW_NORMAL;
+		if (hFile == INVALID_HANDLE_VALUE)
+			return { false, "Could not open the atlas" };
 
-			wcscpy_s(cfi.FaceName, sFont.c_str());
-			if (!SetCurrentConsoleFontEx(hConsoleOut, false, &cfi))
-			{
-				rc.info = "Can't set font";
-				return rc;
-			}
+		LARGE_INTEGER size;
 
-			if (!SetConsoleMode(hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
-			{
-				rc.info = "Could not set console mode (ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT)";
-				return rc;
-			}
+		if (GetFileSizeEx(hFile, &size) && size.QuadPart > 0)
+		{
+			hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
 
-			CONSOLE_SCREEN_BUFFER_INFO csbi;
-			if (!GetConsoleScreenBufferInfo(hConsoleOut, &csbi))
+			if (hMapping)
 			{
-				rc.info = "Could not get console screen buffer info";
-				return rc;
+				pData = (const uint8_t*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+				nSize = (size_t)size.QuadPart;
 			}
+		}
+#else
+		std::string sPath;
+		for (wchar_t c : sFile)
+			sPath += (char)c;
 
-			if (nScreenHeight > csbi.dwMaximumWindowSize.Y)
-			{
-				rc.info = "Specified screen height larger than maximum window height";
-				return rc;
-			}
+		int fd = open(sPath.c_str(), O_RDONLY);
 
-			if (nScreenWidth > csbi.dwMaximumWindowSize.X)
+		if (fd < 0)
+			return { false, "Could not open the atlas" };
+
+		struct stat st;
+
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			if (p != MAP_FAILED)
 			{
-				rc.info = "Specified screen width larger than maximum window width";
-				return rc;
+				pData = (const uint8_t*)p;
+				nSize = (size_t)st.st_size;
 			}
+		}
 
-			rectWindow = { 0, 0, int16_t(nScreenWidth - 1), int16_t(nScreenHeight - 1) };
-			SetConsoleWindowInfo(hConsoleOut, TRUE, &rectWindow);
-			screen = new CHAR_INFO[nScreenWidth * nScreenHeight];
-			memset(screen, 0, sizeof(CHAR_INFO) * nScreenWidth * nScreenHeight);
+		// The mapping keeps the file alive
+		close(fd);
+#endif
 
-			rc.ok = true;
-			rc.info = "Ok";
-			return rc;
+		if (pData == nullptr)
+		{
+			Close();
+			return { false, "Could not map the atlas" };
 		}
 
-		void Run()
-		{
-			bGameThreadActive = true;
+		const Header* pHeader = (const Header*)pData;
 
-			std::thread t = std::thread(&def::ConsoleGameEngine::AppThread, this);
-			t.join();
+		if (nSize < sizeof(Header) || memcmp(pHeader->sMagic, "CGEA", 4) != 0 || pHeader->nVersion != nVersion ||
+			pHeader->nSprites > (nSize - sizeof(Header)) / sizeof(Entry))
+		{
+			Close();
+			return { false, "Not a sprite atlas" };
 		}
 
-	public:
-		template <typename T>
-		void Draw(vec2d_basic<T> pos, int16_t c = 0x2588, int16_t col = 0x000F);
-		void Draw(int32_t x, int32_t y, int16_t c = 0x2588, int16_t col = 0x000F);
+		// Checked once here so Get() and Find() can trust the index
+		const Entry* pIndex = (const Entry*)(pData + sizeof(Header));
 
-		template <typename T>
-		void DrawLine(vec2d_basic<T> pos1, vec2d_basic<T> pos2, int16_t c = 0x2588, int16_t col = 0x000F);
-		void DrawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int16_t c = 0x2588, int16_t col = 0x000F);
+		// A compressed byte decodes to at most 255 (a saturated length
+		// byte), so no honest atlas decodes to more than that many times
+		// its size, altogether or in one sprite
+		uint64_t nDecodedTotal = 0;
 
-		template <typename T>
-		void DrawTriangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, vec2d_basic<T> pos3, int16_t c = 0x2588, int16_t col = 0x000F);
-		void DrawTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, int16_t c = 0x2588, int16_t col = 0x000F);
+		for (uint32_t i = 0; i < pHeader->nSprites; i++)
+		{
+			const Entry& e = pIndex[i];
 
-		template <typename T>
-		void FillTriangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, vec2d_basic<T> pos3, int16_t c = 0x2588, int16_t col = 0x000F);
-		void FillTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, int16_t c = 0x2588, int16_t col = 0x000F);
+			bool bValid = e.nNameOffset <= nSize && e.nNameLength <= nSize - e.nNameOffset &&
+				e.nDataOffset <= nSize && e.nDataSize <= nSize - e.nDataOffset &&
+				e.nWidth > 0 && e.nHeight > 0 && e.nWidth <= 0x8000 && e.nHeight <= 0x8000;
 
-		template <typename T>
-		void DrawRectangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, int16_t c = 0x2588, int16_t col = 0x000F);
-		void DrawRectangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int16_t c = 0x2588, int16_t col = 0x000F);
+			uint64_t nCellBytes = bValid ? (uint64_t)e.nWidth * e.nHeight * sizeof(CHAR_INFO) : 0;
 
-		template <typename T>
-		void DrawRectangleS(vec2d_basic<T> pos, vec2d_basic<T> size, int16_t c = 0x2588, int16_t col = 0x000F);
-		void DrawRectangleS(int32_t x, int32_t y, int32_t size_x, int32_t size_y, int16_t c = 0x2588, int16_t col = 0x000F);
+			if (bValid && !(e.nFlags & nFlagCompressed))
+				bValid = (e.nDataOffset & 3) == 0 && e.nDataSize == nCellBytes;
 
-		template <typename T>
-		void FillRectangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, int16_t c = 0x2588, int16_t col = 0x000F);
-		void FillRectangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int16_t c = 0x2588, int16_t col = 0x000F);
+			if (bValid && (e.nFlags & nFlagCompressed))
+			{
+				nDecodedTotal += nCellBytes;
+				bValid = nCellBytes <= (uint64_t)e.nDataSize * 255 && nDecodedTotal <= (uint64_t)nSize * 255;
+			}
 
-		template <typename T>
-		void FillRectangleS(vec2d_basic<T> pos, vec2d_basic<T> size, int16_t c = 0x2588, int16_t col = 0x000F);
-		void FillRectangleS(int32_t x, int32_t y, int32_t size_x, int32_t size_y, int16_t c = 0x2588, int16_t col = 0x000F);
+			if (!bValid)
+			{
+				Close();
+				return { false, "Corrupt sprite atlas index" };
+			}
+		}
 
-		template <typename T>
-		void DrawCircle(vec2d_basic<T> pos, int32_t radius, int16_t c = 0x2588, int16_t col = 0x000F);
-		void DrawCircle(int32_t x, int32_t y, int32_t radius, int16_t c = 0x2588, int16_t col = 0x000F);
+		pEntries = pIndex;
+		nSprites = (int32_t)pHeader->nSprites;
+		vecDecoded.resize(nSprites);
 
-		template <typename T>
-		void FillCircle(vec2d_basic<T> pos, int32_t radius, int16_t c = 0x2588, int16_t col = 0x000F);
-		void FillCircle(int32_t x, int32_t y, int32_t radius, int16_t c = 0x2588, int16_t col = 0x000F);
+		return { true, "Ok" };
+	}
 
-		template <typename T>
-		void DrawSprite(vec2d_basic<T> pos, Sprite* sprite);
-		void DrawSprite(int32_t x, int32_t y, Sprite* sprite);
+	void SpriteAtlas::Close()
+	{
+#ifdef _WIN32
+		if (pData)
+			UnmapViewOfFile(pData);
 
-		template <typename T>
-		void DrawPartialSprite(vec2d_basic<T> pos, vec2d_basic<T> fpos1, vec2d_basic<T> fpos2, Sprite* sprite);
-		void DrawPartialSprite(int32_t x, int32_t y, int32_t fx1, int32_t fy1, int32_t fx2, int32_t fy2, Sprite* sprite);
+		if (hMapping)
+			CloseHandle(hMapping);
 
-		template <typename T>
-		void DrawPartialSpriteS(vec2d_basic<T> pos, vec2d_basic<T> fpos1, vec2d_basic<T> fpos2, Sprite* sprite);
-		void DrawPartialSpriteS(int32_t x, int32_t y, int32_t fx1, int32_t fy1, int32_t fx2, int32_t fy2, Sprite* sprite);
+		if (hFile != INVALID_HANDLE_VALUE)
+			CloseHandle(hFile);
 
-		void DrawWireFrameModel(std::vector<std::pair<float, float>>& vecModelCoordinates, float x, float y, float r = 0.0f, float s = 1.0f, int16_t c = 0x2588, int16_t col = 0x000F);
+		hMapping = nullptr;
+		hFile = INVALID_HANDLE_VALUE;
+#else
+		if (pData)
+			munmap((void*)pData, nSize);
+#endif
 
-		template <typename T>
-		void DrawString(vec2d_basic<T> pos, std::wstring text, int16_t col = 0x000F);
-		void DrawString(int32_t x, int32_t y, std::wstring text, int16_t col = 0x000F);
+		pData = nullptr;
+		nSize = 0;
+		pEntries = nullptr;
+		nSprites = 0;
+		vecDecoded.clear();
+	}
 
-		void Clear(int16_t c = 0x2588, int16_t col = 0x000F);
+	int32_t SpriteAtlas::Find(const std::string& sName) const
+	{
+		int32_t nLow = 0;
+		int32_t nHigh = nSprites - 1;
 
-		bool MakeSound(std::wstring sFilename, bool bLoop = false);
-		bool Focused();
+		while (nLow <= nHigh)
+		{
+			int32_t nMid = (nLow + nHigh) / 2;
+			const Entry& e = pEntries[nMid];
 
-		template <typename T>
-		inline vec2d_basic<T> GetMouse() const;
+			int nOrder = sName.compare(0, std::string::npos, (const char*)pData + e.nNameOffset, e.nNameLength);
 
-		inline int32_t GetMouseX() const;
-		inline int32_t GetMouseY() const;
+			if (nOrder == 0)
+				return nMid;
 
-		inline KeyState GetMouse(int16_t button) const;
-		inline KeyState GetKey(int16_t key) const;
+			if (nOrder < 0)
+				nHigh = nMid - 1;
+			else
+				nLow = nMid + 1;
+		}
 
-		inline int32_t GetCharacter(bool bHeld = true, bool bPressed = false, bool bReleased = false);
+		return -1;
+	}
 
-		inline int32_t GetScreenWidth() const;
-		inline int32_t GetScreenHeight() const;
+	std::string SpriteAtlas::GetName(int32_t nSprite) const
+	{
+		if (nSprite < 0 || nSprite >= nSprites)
+			return "";
 
-		template <typename T>
-		inline vec2d_basic<T> GetScreenSize() const;
+		return std::string((const char*)pData + pEntries[nSprite].nNameOffset, pEntries[nSprite].nNameLength);
+	}
+
+	SpriteView SpriteAtlas::Get(int32_t nSprite)
+	{
+		if (nSprite < 0 || nSprite >= nSprites)
+			return {};
+
+		const Entry& e = pEntries[nSprite];
+
+		SpriteView view;
+		view.nWidth = e.nWidth;
+		view.nHeight = e.nHeight;
+		view.bOpaque = (e.nFlags & nFlagOpaque) != 0;
+
+		if (!(e.nFlags & nFlagCompressed))
+		{
+			view.pCells = (const CHAR_INFO*)(pData + e.nDataOffset);
+			return view;
+		}
+
+		std::vector<CHAR_INFO>& vecCells = vecDecoded[nSprite];
+
+		if (vecCells.empty())
+		{
+			vecCells.resize((size_t)e.nWidth * e.nHeight);
+
+			if (!Decompress(pData + e.nDataOffset, e.nDataSize, (uint8_t*)vecCells.data(), vecCells.size() * sizeof(CHAR_INFO)))
+			{
+				vecCells.clear();
+				return {};
+			}
+		}
+
+		view.pCells = vecCells.data();
+		return view;
+	}
+
+	rcode SpriteAtlas::Write(const std::wstring& sFile, std::vector<std::pair<std::string, const Sprite*>> vecSprites, bool bCompress)
+	{
+		std::sort(vecSprites.begin(), vecSprites.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+		for (size_t i = 0; i < vecSprites.size(); i++)
+		{
+			if (vecSprites[i].second == nullptr || vecSprites[i].second->nWidth <= 0 || vecSprites[i].second->nHeight <= 0)
+				return { false, "Empty sprite: " + vecSprites[i].first };
+
+			if (i > 0 && vecSprites[i].first == vecSprites[i - 1].first)
+				return { false, "Duplicate sprite name: " + vecSprites[i].first };
+		}
+
+		Header header;
+		memcpy(header.sMagic, "CGEA", 4);
+		header.nVersion = nVersion;
+		header.nSprites = (uint32_t)vecSprites.size();
+		header.nReserved = 0;
+
+		std::vector<Entry> vecEntries(vecSprites.size());
+		std::string sNames;
+
+		size_t nNamesStart = sizeof(Header) + vecEntries.size() * sizeof(Entry);
+
+		for (size_t i = 0; i < vecSprites.size(); i++)
+		{
+			vecEntries[i].nNameOffset = uint32_t(nNamesStart + sNames.size());
+			vecEntries[i].nNameLength = (uint32_t)vecSprites[i].first.size();
+			sNames += vecSprites[i].first;
+		}
+
+		size_t nDataStart = (nNamesStart + sNames.size() + 3) & ~size_t(3);
+
+		std::vector<uint8_t> vecData;
+		std::vector<uint8_t> vecPacked;
+
+		for (size_t i = 0; i < vecSprites.size(); i++)
+		{
+			SpriteView view = vecSprites[i].second->GetView();
+
+			const uint8_t* pRaw = (const uint8_t*)view.pCells;
+			size_t nRaw = (size_t)view.nWidth * view.nHeight * sizeof(CHAR_INFO);
+
+			Entry& e = vecEntries[i];
+			e.nWidth = view.nWidth;
+			e.nHeight = view.nHeight;
+			e.nFlags = view.bOpaque ? nFlagOpaque : 0;
+			e.nReserved = 0;
+
+			if (bCompress)
+			{
+				Compress(pRaw, nRaw, vecPacked);
+
+				if (vecPacked.size() < nRaw)
+				{
+					pRaw = vecPacked.data();
+					nRaw = vecPacked.size();
+					e.nFlags |= nFlagCompressed;
+				}
+			}
+
+			// Stored cells are read in place, so keep them aligned
+			vecData.resize((vecData.size() + 3) & ~size_t(3), 0);
+
+			e.nDataOffset = uint32_t(nDataStart + vecData.size());
+			e.nDataSize = (uint32_t)nRaw;
+
+			vecData.insert(vecData.end(), pRaw, pRaw + nRaw);
+		}
+
+		if (nDataStart + vecData.size() > UINT32_MAX)
+			return { false, "Atlas larger than 4 GB" };
+
+		FILE* f = Sprite::OpenFile(sFile, true);
+
+		if (f == nullptr)
+			return { false, "Could not create the atlas" };
+
+		static const uint8_t nPad[4] = {};
+
+		bool bWritten = fwrite(&header, sizeof(header), 1, f) == 1 &&
+			fwrite(vecEntries.data(), sizeof(Entry), vecEntries.size(), f) == vecEntries.size() &&
+			fwrite(sNames.data(), 1, sNames.size(), f) == sNames.size() &&
+			fwrite(nPad, 1, nDataStart - nNamesStart - sNames.size(), f) == nDataStart - nNamesStart - sNames.size() &&
+			fwrite(vecData.data(), 1, vecData.size(), f) == vecData.size();
+
+		if (fclose(f) != 0 || !bWritten)
+			return { false, "Could not write the atlas" };
+
+		return { true, "Ok" };
+	}
+
+	void SpriteAtlas::Compress(const uint8_t* pSrc, size_t nSize, std::vector<uint8_t>& vecOut)
+	{
+		const int32_t nHashBits = 12;
+		int32_t nTable[1 << nHashBits];
+		std::fill(nTable, nTable + (1 << nHashBits), -1);
+
+		vecOut.clear();
+
+		auto putLength = [&](size_t n)
+		{
+			for (; n >= 255; n -= 255)
+				vecOut.push_back(255);
+
+			vecOut.push_back((uint8_t)n);
+		};
+
+		size_t nAnchor = 0;
+
+		// nMatch is 0 for the closing literals-only sequence
+		auto emit = [&](size_t nLiterals, size_t nMatch, size_t nOffset)
+		{
+			size_t nToken = vecOut.size();
+			vecOut.push_back(uint8_t(std::min<size_t>(nLiterals, 15) << 4));
+
+			if (nLiterals >= 15)
+				putLength(nLiterals - 15);
+
+			vecOut.insert(vecOut.end(), pSrc + nAnchor, pSrc + nAnchor + nLiterals);
+
+			if (nMatch > 0)
+			{
+				vecOut.push_back(uint8_t(nOffset & 0xFF));
+				vecOut.push_back(uint8_t(nOffset >> 8));
+
+				vecOut[nToken] |= (uint8_t)std::min<size_t>(nMatch - 4, 15);
+
+				if (nMatch - 4 >= 15)
+					putLength(nMatch - 4 - 15);
+			}
+		};
+
+		size_t i = 0;
+
+		while (i + 4 <= nSize)
+		{
+			uint32_t nWord;
+			memcpy(&nWord, pSrc + i, 4);
+
+			uint32_t nHash = (nWord * 2654435761u) >> (32 - nHashBits);
+			int32_t nCandidate = nTable[nHash];
+			nTable[nHash] = (int32_t)i;
+
+			if (nCandidate >= 0 && i - nCandidate <= 0xFFFF && memcmp(pSrc + nCandidate, pSrc + i, 4) == 0)
+			{
+				size_t nMatch = 4;
+
+				while (i + nMatch < nSize && pSrc[nCandidate + nMatch] == pSrc[i + nMatch])
+					nMatch++;
+
+				emit(i - nAnchor, nMatch, i - nCandidate);
+
+				i += nMatch;
+				nAnchor = i;
+			}
+			else
+				i++;
+		}
+
+		emit(nSize - nAnchor, 0, 0);
+	}
+
+	bool SpriteAtlas::Decompress(const uint8_t* pSrc, size_t nSrcSize, uint8_t* pDst, size_t nDstSize)
+	{
+		size_t s = 0;
+		size_t d = 0;
+
+		auto getLength = [&](size_t& n)
+		{
+			uint8_t b;
+
+			do
+			{
+				if (s >= nSrcSize)
+					return false;
+
+				b = pSrc[s++];
+				n += b;
+			} while (b == 255);
+
+			return true;
+		};
+
+		while (s < nSrcSize)
+		{
+			uint8_t nToken = pSrc[s++];
+			size_t nLiterals = nToken >> 4;
+
+			if (nLiterals == 15 && !getLength(nLiterals))
+				return false;
+
+			if (nLiterals > nSrcSize - s || nLiterals > nDstSize - d)
+				return false;
+
+			memcpy(pDst + d, pSrc + s, nLiterals);
+			s += nLiterals;
+			d += nLiterals;
+
+			if (s == nSrcSize)
+				break;
+
+			if (nSrcSize - s < 2)
+				return false;
+
+			size_t nOffset = pSrc[s] | (pSrc[s + 1] << 8);
+			s += 2;
+
+			size_t nMatch = nToken & 15;
+
+			if (nMatch == 15 && !getLength(nMatch))
+				return false;
+
+			nMatch += 4;
+
+			if (nOffset == 0 || nOffset > d || nMatch > nDstSize - d)
+				return false;
+
+			// The match may overlap what it's producing, but it repeats with
+			// period nOffset, so each copy can take everything written so far
+			const uint8_t* pFrom = pDst + d - nOffset;
+
+			for (size_t nDone = 0; nDone < nMatch; )
+			{
+				size_t n = std::min(nMatch - nDone, nDone + nOffset);
+				memcpy(pDst + d + nDone, pFrom, n);
+				nDone += n;
+			}
+
+			d += nMatch;
+		}
+
+		return d == nDstSize;
+	}
+
+	// PCM decoded once by ConsoleGameEngine::LoadSound(), always in the
+	// mixer's format: interleaved stereo int16 at SoundMixer::nSampleRate
+	struct Sound
+	{
+		std::vector<int16_t> vecSamples;
+		int32_t nFrames = 0;
+
+		// Reads 8 or 16 bit PCM .wav files, resampling to the mixer's rate
+		bool LoadWav(const std::wstring& sFile);
+	};
+
+	// Sums up to nMaxVoices playing sounds into one stream. Play() and
+	// Stop() are called from the app thread and only queue a command, the
+	// audio thread applies them at the start of its next Mix()
+	class SoundMixer
+	{
+	public:
+		static const int32_t nSampleRate = 44100;
+		static const int32_t nChannels = 2;
+		static const int32_t nMaxVoices = 32;
+
+		// fVolume is clamped to [0, 1]
+		bool Play(const Sound* pSound, bool bLoop, float fVolume = 1.0f);
+
+		// Stops every voice playing pSound, or every voice if it's nullptr
+		bool Stop(const Sound* pSound);
+
+		// Audio thread: fills nFrames stereo frames
+		void Mix(int16_t* pOut, int32_t nFrames);
+
+		uint64_t GetTriggerCount() const { return nTriggers; }
+
+	private:
+		struct Command
+		{
+			const Sound* pSound;
+			bool bPlay;
+			bool bLoop;
+			int16_t nVolume; // Q15
+		};
+
+		struct Voice
+		{
+			const Sound* pSound = nullptr;
+			int32_t nPos = 0; // in frames
+			int16_t nVolume = 0x7FFF;
+			bool bLoop = false;
+			uint64_t nStarted = 0; // the oldest voice is replaced when all are busy
+		};
+
+		bool Push(const Command& cmd);
+		void Apply(const Command& cmd);
+
+		// dst = saturate(dst + src * nVolume), nVolume in Q15
+		static void AddSaturate(int16_t* pDst, const int16_t* pSrc, int32_t nCount, int16_t nVolume);
+
+	private:
+		// Single-producer single-consumer, positions are masked on access
+		Command commands[64];
+		std::atomic<uint32_t> nCmdHead{ 0 };
+		std::atomic<uint32_t> nCmdTail{ 0 };
+
+		Voice voices[nMaxVoices];
+		uint64_t nStarts = 0;
+
+		std::atomic<uint64_t> nTriggers{ 0 };
+	};
+
+	bool Sound::LoadWav(const std::wstring& sFile)
+	{
+		FILE* f = Sprite::OpenFile(sFile, false);
+
+		if (f == nullptr)
+			return false;
+
+		std::vector<uint8_t> vecFile;
+
+		std::fseek(f, 0, SEEK_END);
+		vecFile.resize(std::max(std::ftell(f), 0L));
+		std::fseek(f, 0, SEEK_SET);
+
+		size_t nRead = std::fread(vecFile.data(), 1, vecFile.size(), f);
+		std::fclose(f);
+
+		auto u16 = [&](size_t i) { return uint32_t(vecFile[i] | vecFile[i + 1] << 8); };
+		auto u32 = [&](size_t i) { return u16(i) | u16(i + 2) << 16; };
+
+		if (nRead != vecFile.size() || nRead < 12 || memcmp(&vecFile[0], "RIFF", 4) != 0 || memcmp(&vecFile[8], "WAVE", 4) != 0)
+			return false;
+
+		uint32_t nFormat = 0, nSrcChannels = 0, nSrcRate = 0, nBits = 0;
+		size_t nData = 0, nDataSize = 0;
+
+		// Chunks are word aligned, anything but fmt and data is skipped
+		for (size_t i = 12; i + 8 <= nRead; i += 8 + ((u32(i + 4) + 1) & ~1u))
+		{
+			size_t nSize = std::min<size_t>(u32(i + 4), nRead - i - 8);
+
+			if (memcmp(&vecFile[i], "fmt ", 4) == 0 && nSize >= 16)
+			{
+				nFormat = u16(i + 8);
+				nSrcChannels = u16(i + 10);
+				nSrcRate = u32(i + 12);
+				nBits = u16(i + 22);
+			}
+			else if (memcmp(&vecFile[i], "data", 4) == 0)
+			{
+				nData = i + 8;
+				nDataSize = nSize;
+			}
+		}
+
+		// PCM, or WAVE_FORMAT_EXTENSIBLE which for 8/16 bit is PCM too
+		if ((nFormat != 1 && nFormat != 0xFFFE) || (nBits != 8 && nBits != 16) || nSrcChannels == 0 || nSrcRate == 0 || nData == 0)
+			return false;
+
+		size_t nFrameBytes = nSrcChannels * nBits / 8;
+		size_t nSrcFrames = nDataSize / nFrameBytes;
+
+		if (nSrcFrames == 0)
+			return false;
+
+		auto sample = [&](size_t nFrame, uint32_t nChannel) -> int32_t
+		{
+			size_t i = nData + nFrame * nFrameBytes + std::min(nChannel, nSrcChannels - 1) * (nBits / 8);
+			return nBits == 8 ? (int32_t(vecFile[i]) - 128) << 8 : int32_t(int16_t(u16(i)));
+		};
+
+		// Linear resampling, good enough for effects and done only once
+		nFrames = int32_t((uint64_t)nSrcFrames * SoundMixer::nSampleRate / nSrcRate);
+		vecSamples.resize((size_t)nFrames * SoundMixer::nChannels);
+
+		double fStep = (double)nSrcRate / SoundMixer::nSampleRate;
+
+		for (int32_t i = 0; i < nFrames; i++)
+		{
+			double fPos = i * fStep;
+			size_t n0 = (size_t)fPos;
+			size_t n1 = std::min(n0 + 1, nSrcFrames - 1);
+			double fFrac = fPos - (double)n0;
+
+			for (uint32_t c = 0; c < (uint32_t)SoundMixer::nChannels; c++)
+				vecSamples[i * SoundMixer::nChannels + c] = int16_t(sample(n0, c) + (sample(n1, c) - sample(n0, c)) * fFrac);
+		}
+
+		return nFrames > 0;
+	}
+
+	bool SoundMixer::Play(const Sound* pSound, bool bLoop, float fVolume)
+	{
+		if (pSound == nullptr || pSound->nFrames == 0)
+			return false;
+
+		fVolume = std::min(std::max(fVolume, 0.0f), 1.0f);
+
+		if (!Push({ pSound, true, bLoop, int16_t(fVolume * 32767.0f) }))
+			return false;
+
+		nTriggers++;
+		return true;
+	}
+
+	bool SoundMixer::Stop(const Sound* pSound)
+	{
+		return Push({ pSound, false, false, 0 });
+	}
+
+	void SoundMixer::Mix(int16_t* pOut, int32_t nFrames)
+	{
+		uint32_t nHead = nCmdHead.load(std::memory_order_relaxed);
+		uint32_t nTail = nCmdTail.load(std::memory_order_acquire);
+
+		for (; nHead != nTail; nHead++)
+			Apply(commands[nHead % 64]);
+
+		nCmdHead.store(nHead, std::memory_order_release);
+
+		memset(pOut, 0, nFrames * nChannels * sizeof(int16_t));
+
+		for (Voice& v : voices)
+		{
+			int32_t nDone = 0;
+
+			while (v.pSound && nDone < nFrames)
+			{
+				int32_t n = std::min(nFrames - nDone, v.pSound->nFrames - v.nPos);
+
+				AddSaturate(pOut + nDone * nChannels, &v.pSound->vecSamples[v.nPos * nChannels], n * nChannels, v.nVolume);
+
+				nDone += n;
+				v.nPos += n;
+
+				if (v.nPos == v.pSound->nFrames)
+				{
+					v.nPos = 0;
+
+					if (!v.bLoop)
+						v.pSound = nullptr;
+				}
+			}
+		}
+	}
+
+	bool SoundMixer::Push(const Command& cmd)
+	{
+		uint32_t nTail = nCmdTail.load(std::memory_order_relaxed);
+
+		// full, the audio thread isn't keeping up (or there is none)
+		if (nTail - nCmdHead.load(std::memory_order_acquire) == 64)
+			return false;
+
+		commands[nTail % 64] = cmd;
+		nCmdTail.store(nTail + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	void SoundMixer::Apply(const Command& cmd)
+	{
+		if (!cmd.bPlay)
+		{
+			for (Voice& v : voices)
+			{
+				if (cmd.pSound == nullptr || v.pSound == cmd.pSound)
+					v.pSound = nullptr;
+			}
+
+			return;
+		}
+
+		// A free voice, otherwise the one that has been playing longest
+		Voice* pVoice = &voices[0];
+
+		for (Voice& v : voices)
+		{
+			if (v.pSound == nullptr)
+			{
+				pVoice = &v;
+				break;
+			}
+
+			if (v.nStarted < pVoice->nStarted)
+				pVoice = &v;
+		}
+
+		pVoice->pSound = cmd.pSound;
+		pVoice->nPos = 0;
+		pVoice->nVolume = cmd.nVolume;
+		pVoice->bLoop = cmd.bLoop;
+		pVoice->nStarted = nStarts++;
+	}
+
+	void SoundMixer::AddSaturate(int16_t* pDst, const int16_t* pSrc, int32_t nCount, int16_t nVolume)
+	{
+		bool bFull = nVolume == 0x7FFF;
+		int32_t i = 0;
+
+#ifdef DEF_CGE_SSE2
+		// mulhi keeps the top 16 bits of the product, the shift makes it Q15
+		const __m128i vVolume = _mm_set1_epi16(nVolume);
+
+		for (; i + 8 <= nCount; i += 8)
+		{
+			__m128i vSrc = _mm_loadu_si128((const __m128i*)(pSrc + i));
+
+			if (!bFull)
+				vSrc = _mm_slli_epi16(_mm_mulhi_epi16(vSrc, vVolume), 1);
+
+			__m128i vDst = _mm_loadu_si128((const __m128i*)(pDst + i));
+			_mm_storeu_si128((__m128i*)(pDst + i), _mm_adds_epi16(vDst, vSrc));
+		}
+#endif
+
+		for (; i < nCount; i++)
+		{
+			int32_t nSrc = bFull ? pSrc[i] : ((pSrc[i] * nVolume) >> 16) * 2;
+			pDst[i] = (int16_t)std::min(std::max(pDst[i] + nSrc, -32768), 32767);
+		}
+	}
+
+	// Frame times in microseconds, bucketed HDR-style: exact below 64 us,
+	// then 32 buckets per power of two (about 3% precision) up to a minute.
+	// Recording is constant time and the memory is fixed
+	class FrameTimeHistogram
+	{
+	public:
+		void Record(int64_t nMicroseconds);
+		void Reset();
+
+		// Upper edge of the bucket holding the fPercent'th percentile
+		int64_t Percentile(float fPercent) const;
+
+		int64_t Max() const { return nMax; }
+		uint64_t Count() const { return nCount; }
+		int64_t Total() const { return nTotal; }
+
+	private:
+		static const int32_t nSubBuckets = 32;
+		static const int32_t nMaxShift = 20; // 64 << 20 us is about 67 s
+
+		uint32_t nCounts[(nMaxShift + 2) * nSubBuckets] = {};
+		uint64_t nCount = 0;
+		int64_t nTotal = 0;
+		int64_t nMax = 0;
+	};
+
+	// Holds a thread to a target rate on the steady clock. Sleeps until
+	// just before each deadline and spins the rest, the spin margin
+	// following how late the OS actually wakes us
+	class FramePacer
+	{
+	public:
+		void SetRate(float fFramesPerSecond); // 0 for no limit
+		float GetRate() const;
+
+		// Returns at the end of the current frame's period
+		void Wait();
+
+	private:
+		using Clock = std::chrono::steady_clock;
+
+		Clock::duration period = Clock::duration::zero();
+		Clock::duration spin = std::chrono::microseconds(1000);
+		Clock::time_point tpNext;
+		bool bStarted = false;
+	};
+
+	void FrameTimeHistogram::Record(int64_t nMicroseconds)
+	{
+		int64_t v = std::min(std::max(nMicroseconds, int64_t(0)), (int64_t(64) << nMaxShift) - 1);
+		int32_t nShift = 0;
+
+		while ((v >> nShift) >= 64)
+			nShift++;
+
+		nCounts[nShift * nSubBuckets + (v >> nShift)]++;
+		nCount++;
+		nTotal += v;
+		nMax = std::max(nMax, v);
+	}
+
+	void FrameTimeHistogram::Reset()
+	{
+		memset(nCounts, 0, sizeof(nCounts));
+		nCount = 0;
+		nTotal = 0;
+		nMax = 0;
+	}
+
+	int64_t FrameTimeHistogram::Percentile(float fPercent) const
+	{
+		uint64_t nTarget = std::max<uint64_t>(1, (uint64_t)std::ceil(nCount * fPercent / 100.0f));
+		uint64_t nSeen = 0;
+
+		for (int32_t i = 0; i < (nMaxShift + 2) * nSubBuckets; i++)
+		{
+			nSeen += nCounts[i];
+
+			if (nSeen >= nTarget)
+			{
+				int32_t nShift = i < 2 * nSubBuckets ? 0 : i / nSubBuckets - 1;
+				int64_t nUpper = ((int64_t(i - nShift * nSubBuckets) + 1) << nShift) - 1;
+
+				return std::min(nUpper, nMax);
+			}
+		}
+
+		return nMax;
+	}
+
+	void FramePacer::SetRate(float fFramesPerSecond)
+	{
+		period = fFramesPerSecond > 0.0f ?
+			std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / fFramesPerSecond)) :
+			Clock::duration::zero();
+
+		spin = std::min<Clock::duration>(std::chrono::microseconds(1000), period / 4);
+		bStarted = false;
+	}
+
+	float FramePacer::GetRate() const
+	{
+		return period.count() > 0 ? float(1.0 / std::chrono::duration<double>(period).count()) : 0.0f;
+	}
+
+	void FramePacer::Wait()
+	{
+		if (period.count() == 0)
+			return;
+
+		Clock::time_point tpNow = Clock::now();
+
+		if (!bStarted)
+		{
+			tpNext = tpNow;
+			bStarted = true;
+		}
+
+		tpNext += period;
+
+		// More than a frame behind: start over from now rather than
+		// rushing through frames to catch up
+		if (tpNow >= tpNext)
+		{
+			tpNext = tpNow;
+			return;
+		}
+
+		Clock::time_point tpWake = tpNext - spin;
+
+		if (tpNow < tpWake)
+		{
+			std::this_thread::sleep_until(tpWake);
+
+			// Keep the latest oversleep plus some slack in hand, growing at
+			// once and shrinking gradually. Capped, since an OS hiccup that
+			// costs one late frame is cheaper than spinning for a second
+			Clock::duration target = std::min<Clock::duration>(Clock::now() - tpWake + std::chrono::microseconds(250), period / 4);
+
+			if (target > spin)
+				spin = target;
+			else
+				spin -= (spin - target) / 16;
+		}
+
+		while (Clock::now() < tpNext)
+			std::this_thread::yield();
+	}
+
+	// A key going down or up. nTime is in microseconds on the platform's
+	// clock (virtual for headless runs), for measuring input latency
+	struct InputEvent
+	{
+		int16_t nKey; // virtual key code
+		bool bDown;
+		int64_t nTime;
+	};
+
+	// What a platform reports back each frame
+	struct PlatformInput
+	{
+		// Key changes since the last poll in the order they happened. The
+		// engine clears it before every PollInput(), platforms only append
+		std::vector<InputEvent> vecEvents;
+		bool mouse[5] = { false };
+
+		int32_t nMouseX = 0;
+		int32_t nMouseY = 0;
+
+		bool bFocused = true;
+		bool bQuit = false;
+	};
+
+	// Everything ConsoleGameEngine needs from the outside world: output,
+	// input, audio and a clock. Set one with SetPlatform() before
+	// ConstructConsole(), otherwise the native one for the OS is used
+	class Platform
+	{
+	public:
+		virtual ~Platform() = default;
+
+		virtual rcode Construct(int32_t width, int32_t height, int32_t fontw, int32_t fonth, const std::wstring& sFont) = 0;
+		virtual void SetTitle(const std::wstring& sTitle) = 0;
+
+		// pRegions is nullptr when the whole buffer should be shown
+		virtual void Present(const CHAR_INFO* pCells, int32_t width, int32_t height, const std::vector<SMALL_RECT>* pRegions) = 0;
+
+		virtual void PollInput(PlatformInput& input) = 0;
+
+		// Starts pulling from pMixer on the platform's own thread or device,
+		// false if there is no audio output
+		virtual bool OpenAudio(SoundMixer*) { return false; }
+
+		// Seconds since the previous call
+		virtual float GetElapsedTime() = 0;
+
+		// False when time is simulated and nothing should wait on the wall clock
+		virtual bool IsRealTime() const { return true; }
+
+		// Bytes sent to the output for the last presented frame, if that means anything
+		virtual size_t GetBytesWritten() const { return 0; }
+	};
+
+#ifdef _WIN32
+	class PlatformWin32Console : public Platform
+	{
+	public:
+		PlatformWin32Console()
+		{
+			hConsoleOut = GetStdHandle(STD_OUTPUT_HANDLE);
+			hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+
+			hWnd = GetConsoleWindow();
+
+			hDC = GetDC(hWnd);
+
+			// 1 ms sleeps instead of the default 15.6, or the pacer would
+			// have to spin for most of each frame
+			timeBeginPeriod(1);
+		}
+
+		~PlatformWin32Console()
+		{
+			timeEndPeriod(1);
+
+			if (tAudio.joinable())
+			{
+				bAudioActive = false;
+				tAudio.join();
+
+				waveOutReset(hWaveOut);
+
+				for (WAVEHDR& hdr : audioHeaders)
+				{
+					if (hdr.dwFlags & WHDR_PREPARED)
+						waveOutUnprepareHeader(hWaveOut, &hdr, sizeof(WAVEHDR));
+				}
+
+				waveOutClose(hWaveOut);
+			}
+
+			if (hAudioEvent)
+				CloseHandle(hAudioEvent);
+		}
+
+	private:
+		HANDLE hConsoleOut;
+		HANDLE hConsoleIn;
+		SMALL_RECT rectWindow;
+		HWND hWnd;
+		HDC hDC;
+
+		std::chrono::steady_clock::time_point tpLast = std::chrono::steady_clock::now();
+
+		static const int32_t nAudioBlocks = 4;
+		static const int32_t nAudioBlockFrames = 512;
+
+		SoundMixer* pAudioMixer = nullptr;
+		HWAVEOUT hWaveOut = nullptr;
+		HANDLE hAudioEvent = nullptr;
+		WAVEHDR audioHeaders[nAudioBlocks]{};
+		int16_t audioBlocks[nAudioBlocks][nAudioBlockFrames * SoundMixer::nChannels];
+		std::thread tAudio;
+		std::atomic<bool> bAudioActive{ false };
+
+	public:
+		rcode Construct(int32_t width, int32_t height, int32_t fontw, int32_t fonth, const std::wstring& sFont) override
+		{
+			rcode rc;
+			rc.ok = false;
+
+			hConsoleOut = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
+
+			if (hConsoleOut == INVALID_HANDLE_VALUE)
+			{
+				rc.info = "Can't create console screen buffer for output";
+				return rc;
+			}
+
+			rectWindow = { 0, 0, 1, 1 };
+			SetConsoleWindowInfo(hConsoleOut, TRUE, &rectWindow);
+
+			COORD coord = { (int16_t)width, (int16_t)height };
+			if (!SetConsoleScreenBufferSize(hConsoleOut, coord))
+			{
+				rc.info = "Too large or to small screen width or height";
+				return rc;
+			}
+
+			if (!SetConsoleActiveScreenBuffer(hConsoleOut))
+			{
+				rc.info = "Can't set console screen buffer";
+				return rc;
+			}
+
+			CONSOLE_FONT_INFOEX cfi;
+			cfi.cbSize = sizeof(cfi);
+			cfi.nFont = 0;
+			cfi.dwFontSize.X = fontw;
+			cfi.dwFontSize.Y = fonth;
+			cfi.FontFamily = FF_DONTCARE;
+			cfi.FontWeight = FW_NORMAL;
+
+			wcscpy_s(cfi.FaceName, sFont.c_str());
+			if (!SetCurrentConsoleFontEx(hConsoleOut, false, &cfi))
+			{
+				rc.info = "Can't set font";
+				return rc;
+			}
+
+			if (!SetConsoleMode(hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
+			{
+				rc.info = "Could not set console mode (ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT)";
+				return rc;
+			}
+
+			CONSOLE_SCREEN_BUFFER_INFO csbi;
+			if (!GetConsoleScreenBufferInfo(hConsoleOut, &csbi))
+			{
+				rc.info = "Could not get console screen buffer info";
+				return rc;
+			}
+
+			if (height > csbi.dwMaximumWindowSize.Y)
+			{
+				rc.info = "Specified screen height larger than maximum window height";
+				return rc;
+			}
+
+			if (width > csbi.dwMaximumWindowSize.X)
+			{
+				rc.info = "Specified screen width larger than maximum window width";
+				return rc;
+			}
+
+			rectWindow = { 0, 0, int16_t(width - 1), int16_t(height - 1) };
+			SetConsoleWindowInfo(hConsoleOut, TRUE, &rectWindow);
+
+			rc.ok = true;
+			rc.info = "Ok";
+			return rc;
+		}
+
+		void SetTitle(const std::wstring& sTitle) override
+		{
+			SetConsoleTitleW(sTitle.c_str());
+		}
+
+		void Present(const CHAR_INFO* pCells, int32_t width, int32_t height, const std::vector<SMALL_RECT>* pRegions) override
+		{
+			if (pRegions)
+			{
+				for (SMALL_RECT rect : *pRegions)
+					WriteConsoleOutputW(hConsoleOut, pCells, { (int16_t)width, (int16_t)height }, { rect.Left, rect.Top }, &rect);
+			}
+			else
+				WriteConsoleOutputW(hConsoleOut, pCells, { (int16_t)width, (int16_t)height }, { 0,0 }, &rectWindow);
+		}
+
+		void PollInput(PlatformInput& input) override
+		{
+			int64_t nNow = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+			INPUT_RECORD inBuf[32];
+			DWORD events = 0;
+
+			while (GetNumberOfConsoleInputEvents(hConsoleIn, &events) && events > 0)
+			{
+				if (!ReadConsoleInputW(hConsoleIn, inBuf, std::min<DWORD>(events, 32), &events))
+					break;
+
+				for (DWORD i = 0; i < events; i++)
+					HandleRecord(inBuf[i], nNow, input);
+			}
+		}
+
+		bool OpenAudio(SoundMixer* pMixer) override
+		{
+			pAudioMixer = pMixer;
+			hAudioEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+
+			WAVEFORMATEX wfx{};
+			wfx.wFormatTag = WAVE_FORMAT_PCM;
+			wfx.nChannels = SoundMixer::nChannels;
+			wfx.nSamplesPerSec = SoundMixer::nSampleRate;
+			wfx.wBitsPerSample = 16;
+			wfx.nBlockAlign = wfx.nChannels * sizeof(int16_t);
+			wfx.nAvgBytesPerSec = wfx.nSamplesPerSec * wfx.nBlockAlign;
+
+			// The event is signalled whenever the device finishes a block
+			if (waveOutOpen(&hWaveOut, WAVE_MAPPER, &wfx, (DWORD_PTR)hAudioEvent, 0, CALLBACK_EVENT) != MMSYSERR_NOERROR)
+				return false;
+
+			bAudioActive = true;
+			tAudio = std::thread(&PlatformWin32Console::AudioThread, this);
+
+			return true;
+		}
+
+		float GetElapsedTime() override
+		{
+			auto tpNow = std::chrono::steady_clock::now();
+			std::chrono::duration<float> elapsedTime = tpNow - tpLast;
+			tpLast = tpNow;
+
+			return elapsedTime.count();
+		}
+
+	private:
+		void HandleRecord(const INPUT_RECORD& record, int64_t nNow, PlatformInput& input)
+		{
+			switch (record.EventType)
+			{
+			case KEY_EVENT:
+			{
+				// Auto-repeat arrives as more key downs, the engine ignores them
+				const KEY_EVENT_RECORD& key = record.Event.KeyEvent;
+				input.vecEvents.push_back({ (int16_t)(key.wVirtualKeyCode & 0xFF), key.bKeyDown != FALSE, nNow });
+			}
+			break;
+
+			case FOCUS_EVENT:
+				input.bFocused = record.Event.FocusEvent.bSetFocus;
+				break;
+
+			case MOUSE_EVENT:
+			{
+				switch (record.Event.MouseEvent.dwEventFlags)
+				{
+				case MOUSE_MOVED:
+				{
+					input.nMouseX = record.Event.MouseEvent.dwMousePosition.X;
+					input.nMouseY = record.Event.MouseEvent.dwMousePosition.Y;
+				}
+				break;
+
+				case 0:
+				{
+					for (int m = 0; m < 5; m++)
+						input.mouse[m] = (record.Event.MouseEvent.dwButtonState & (1 << m)) > 0;
+				}
+				break;
+
+				default:
+					break;
+				}
+			}
+			break;
+
+			default:
+				break;
+			}
+		}
+
+		// Keeps every block queued on the device, refilling each one from
+		// the mixer as soon as it has been played
+		void AudioThread()
+		{
+			int32_t nBlock = 0;
+
+			while (bAudioActive)
+			{
+				WAVEHDR& hdr = audioHeaders[nBlock];
+
+				if (hdr.dwFlags & WHDR_INQUEUE)
+				{
+					WaitForSingleObject(hAudioEvent, 100);
+					continue;
+				}
+
+				if (hdr.dwFlags & WHDR_PREPARED)
+					waveOutUnprepareHeader(hWaveOut, &hdr, sizeof(WAVEHDR));
+
+				pAudioMixer->Mix(audioBlocks[nBlock], nAudioBlockFrames);
+
+				hdr = WAVEHDR{};
+				hdr.lpData = (LPSTR)audioBlocks[nBlock];
+				hdr.dwBufferLength = sizeof(audioBlocks[nBlock]);
+
+				waveOutPrepareHeader(hWaveOut, &hdr, sizeof(WAVEHDR));
+				waveOutWrite(hWaveOut, &hdr, sizeof(WAVEHDR));
+
+				nBlock = (nBlock + 1) % nAudioBlocks;
+			}
+		}
+	};
+#else
+	enum class TerminalOutput
+	{
+		HalfBlock, // text, works everywhere
+		Sixel,
+		Kitty // kitty graphics protocol
+	};
+
+	// Renders the cell buffer on an ANSI terminal. Two vertically adjacent
+	// cells share one character (upper half block, foreground on top), and
+	// only characters that changed since the previous frame are sent, all
+	// in a single write()
+	class PlatformAnsiTerminal : public Platform
+	{
+	public:
+		// The graphics modes draw each cell as a fontw x fonth block of pixels
+		PlatformAnsiTerminal(TerminalOutput mode = TerminalOutput::HalfBlock)
+		{
+			output = mode;
+		}
+
+		~PlatformAnsiTerminal()
+		{
+			Close();
+		}
+
+	public:
+		// Terminals don't report key releases, so a key counts as held
+		// until it hasn't been seen (or auto-repeated) for this long
+		int32_t nKeyHoldMs = 150;
+
+	private:
+		termios termOld;
+		bool bOpen = false;
+
+		int32_t nCellsX = 0;
+		int32_t nCellsY = 0;
+		int32_t nRows = 0;
+
+		int32_t nVisibleX = 0;
+		int32_t nVisibleY = 0;
+
+		TerminalOutput output;
+		int32_t nPixelW = 1;
+		int32_t nPixelH = 1;
+
+		// Colour per cell for the graphics modes, (top << 4 | bottom) per
+		// character for half blocks. 0xFF forces a redraw
+		std::vector<uint8_t> vecPrev;
+
+		// Reused every frame so encoding doesn't allocate
+		std::string sOut;
+		std::vector<uint8_t> vecRowChanged;
+		std::vector<uint8_t> vecMasks;
+		std::vector<uint8_t> vecPng;
+		size_t nBytesWritten = 0;
+
+		bool bImageSent = false;
+		int32_t nDisplayCols = 0;
+		int32_t nDisplayRows = 0;
+
+		std::chrono::steady_clock::time_point tpLast = std::chrono::steady_clock::now();
+
+		std::chrono::steady_clock::time_point tpKeySeen[256];
+		bool bKeySeen[256] = { false };
+		std::vector<int16_t> vecKeysHeld; // the keys with bKeySeen set
+
+	public:
+		rcode Construct(int32_t width, int32_t height, int32_t fontw, int32_t fonth, const std::wstring&) override
+		{
+			rcode rc;
+			rc.ok = false;
+
+			if (tcgetattr(STDIN_FILENO, &termOld) != 0)
+			{
+				rc.info = "Can't read the terminal attributes";
+				return rc;
+			}
+
+			termios raw = termOld;
+			raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+			raw.c_iflag &= ~(IXON | ICRNL);
+			raw.c_cc[VMIN] = 0;
+			raw.c_cc[VTIME] = 0;
+
+			if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) != 0)
+			{
+				rc.info = "Can't switch the terminal to raw mode";
+				return rc;
+			}
+
+			bOpen = true;
+
+			nCellsX = width;
+			nCellsY = height;
+			nRows = (height + 1) / 2;
+
+			// Anything beyond the terminal is clipped rather than wrapped
+			nVisibleX = nCellsX;
+			nVisibleY = nRows;
+
+			nPixelW = fontw;
+			nPixelH = fonth;
+
+			winsize ws;
+			if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0)
+			{
+				nVisibleX = std::min(nVisibleX, (int32_t)ws.ws_col);
+				nVisibleY = std::min(nVisibleY, (int32_t)ws.ws_row);
+
+				// Kitty scales the image itself, so it needs the size in
+				// character cells that nPixelW x nPixelH per cell works out to
+				if (ws.ws_xpixel > 0 && ws.ws_ypixel > 0)
+				{
+					int32_t nCharW = ws.ws_xpixel / ws.ws_col;
+					int32_t nCharH = ws.ws_ypixel / ws.ws_row;
+
+					nDisplayCols = (nCellsX * nPixelW + nCharW - 1) / nCharW;
+					nDisplayRows = (nCellsY * nPixelH + nCharH - 1) / nCharH;
+				}
+			}
+
+			if (output == TerminalOutput::HalfBlock)
+			{
+				vecPrev.assign(nCellsX * nRows, 0xFF);
+				sOut.reserve(nVisibleX * nVisibleY * 16);
+			}
+			else
+			{
+				vecPrev.assign(nCellsX * nCellsY, 0xFF);
+				vecRowChanged.assign(nCellsY, 0);
+				vecMasks.assign(16 * nCellsX, 0);
+			}
+
+			// Alternate screen, hidden cursor
+			Write("\x1b[?1049h\x1b[?25l\x1b[2J");
+
+			rc.ok = true;
+			rc.info = "Ok";
+			return rc;
+		}
+
+		void Close()
+		{
+			if (!bOpen)
+				return;
+
+			Write("\x1b[0m\x1b[?25h\x1b[?1049l");
+			tcsetattr(STDIN_FILENO, TCSAFLUSH, &termOld);
+
+			bOpen = false;
+		}
+
+		void SetTitle(const std::wstring& sTitle) override
+		{
+			std::string sOsc = "\x1b]0;";
+
+			for (wchar_t c : sTitle)
+				AppendUtf8(sOsc, c);
+
+			sOsc += '\x07';
+			Write(sOsc.data(), sOsc.size());
+		}
+
+		// Cells are diffed here, so dirty regions make no difference
+		void Present(const CHAR_INFO* pCells, int32_t, int32_t, const std::vector<SMALL_RECT>*) override
+		{
+			if (output != TerminalOutput::HalfBlock)
+			{
+				PresentPixels(pCells);
+				return;
+			}
+
+			sOut.clear();
+
+			int32_t nCursorX = -1;
+			int32_t nCursorY = -1;
+
+			int32_t nFg = -1;
+			int32_t nBg = -1;
+
+			for (int32_t cy = 0; cy < nVisibleY; cy++)
+			{
+				const CHAR_INFO* pTop = &pCells[(2 * cy) * nCellsX];
+				const CHAR_INFO* pBottom = (2 * cy + 1 < nCellsY) ? pTop + nCellsX : nullptr;
+
+				for (int32_t cx = 0; cx < nVisibleX; cx++)
+				{
+					uint8_t nTop = CellColour(pTop[cx]);
+					uint8_t nBottom = pBottom ? CellColour(pBottom[cx]) : 0;
+					uint8_t nPacked = (nTop << 4) | nBottom;
+
+					uint8_t& nPrev = vecPrev[cy * nCellsX + cx];
+
+					if (nPacked == nPrev)
+						continue;
+
+					nPrev = nPacked;
+
+					if (cy != nCursorY)
+					{
+						sOut += "\x1b[";
+						AppendNumber(cy + 1);
+						sOut += ';';
+						AppendNumber(cx + 1);
+						sOut += 'H';
+					}
+					else if (cx != nCursorX)
+					{
+						sOut += "\x1b[";
+						AppendNumber(cx - nCursorX);
+						sOut += 'C';
+					}
+
+					// A solid pair only needs the background
+					bool bSolid = nTop == nBottom;
+					bool bSetFg = !bSolid && nFg != nTop;
+					bool bSetBg = nBg != nBottom;
+
+					if (bSetFg || bSetBg)
+					{
+						sOut += "\x1b[";
+
+						if (bSetFg)
+						{
+							AppendNumber(AnsiColour(nTop));
+							nFg = nTop;
+						}
+
+						if (bSetFg && bSetBg)
+							sOut += ';';
+
+						if (bSetBg)
+						{
+							AppendNumber(AnsiColour(nBottom) + 10);
+							nBg = nBottom;
+						}
+
+						sOut += 'm';
+					}
+
+					if (bSolid)
+						sOut += ' ';
+					else
+						sOut += "\xE2\x96\x80";
+
+					nCursorX = cx + 1;
+					nCursorY = cy;
+				}
+			}
+
+			if (!sOut.empty())
+				Write(sOut.data(), sOut.size());
+
+			nBytesWritten = sOut.size();
+		}
+
+		void PollInput(PlatformInput& input) override
+		{
+			auto tpNow = std::chrono::steady_clock::now();
+			int64_t nNow = std::chrono::duration_cast<std::chrono::microseconds>(tpNow.time_since_epoch()).count();
+
+			char buf[64];
+			ssize_t n;
+
+			while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+			{
+				for (ssize_t i = 0; i < n; i++)
+				{
+					uint8_t ch = buf[i];
+					int16_t vk = 0;
+
+					if (ch == 0x03)
+						input.bQuit = true;
+					else if (ch == 0x1B && i + 2 < n && (buf[i + 1] == '[' || buf[i + 1] == 'O'))
+					{
+						char cIntro = buf[i + 1];
+						int32_t nParam = 0;
+
+						i += 2;
+
+						while (i < n && buf[i] >= '0' && buf[i] <= '9')
+							nParam = nParam * 10 + (buf[i++] - '0');
+
+						if (i < n)
+							vk = DecodeEscape(cIntro, nParam, buf[i]);
+					}
+					else
+						vk = DecodeChar(ch);
+
+					if (vk > 0 && vk < 256)
+					{
+						if (!bKeySeen[vk])
+						{
+							input.vecEvents.push_back({ vk, true, nNow });
+							vecKeysHeld.push_back(vk);
+						}
+
+						tpKeySeen[vk] = tpNow;
+						bKeySeen[vk] = true;
+					}
+				}
+			}
+
+			for (size_t k = 0; k < vecKeysHeld.size();)
+			{
+				int16_t vk = vecKeysHeld[k];
+
+				if (tpNow - tpKeySeen[vk] > std::chrono::milliseconds(nKeyHoldMs))
+				{
+					input.vecEvents.push_back({ vk, false, nNow });
+					bKeySeen[vk] = false;
+
+					vecKeysHeld[k] = vecKeysHeld.back();
+					vecKeysHeld.pop_back();
+				}
+				else
+					k++;
+			}
+		}
+
+		float GetElapsedTime() override
+		{
+			auto tpNow = std::chrono::steady_clock::now();
+			std::chrono::duration<float> elapsedTime = tpNow - tpLast;
+			tpLast = tpNow;
+
+			return elapsedTime.count();
+		}
+
+		size_t GetBytesWritten() const override
+		{
+			return nBytesWritten;
+		}
+
+	private:
+		void PresentPixels(const CHAR_INFO* pCells)
+		{
+			sOut.clear();
+
+			// Colour index per cell, and which cell rows differ from what
+			// the terminal already shows
+			int32_t nFirstChanged = -1;
+			int32_t nLastChanged = -1;
+
+			for (int32_t y = 0; y < nCellsY; y++)
+			{
+				bool bChanged = false;
+
+				for (int32_t x = 0; x < nCellsX; x++)
+				{
+					uint8_t nColour = CellColour(pCells[y * nCellsX + x]);
+					uint8_t& nPrev = vecPrev[y * nCellsX + x];
+
+					bChanged |= nPrev != nColour;
+					nPrev = nColour;
+				}
+
+				vecRowChanged[y] = bChanged;
+
+				if (bChanged)
+				{
+					if (nFirstChanged < 0)
+						nFirstChanged = y;
+
+					nLastChanged = y;
+				}
+			}
+
+			if (nFirstChanged >= 0)
+			{
+				if (output == TerminalOutput::Sixel)
+					EncodeSixel(nLastChanged);
+				else
+					EncodeKitty();
+			}
+
+			if (!sOut.empty())
+				Write(sOut.data(), sOut.size());
+
+			nBytesWritten = sOut.size();
+		}
+
+		// Each cell becomes an nPixelW x nPixelH block. The image is drawn
+		// with transparent zero bits, so 6-pixel bands without a changed
+		// row cost a single '-' and nothing after the last changed one
+		// is sent at all
+		void EncodeSixel(int32_t nLastChangedRow)
+		{
+			int32_t nWidthPx = nCellsX * nPixelW;
+			int32_t nHeightPx = nCellsY * nPixelH;
+
+			sOut += "\x1b[H\x1bP0;1;0q\"1;1;";
+			AppendNumber(nWidthPx);
+			sOut += ';';
+			AppendNumber(nHeightPx);
+
+			for (int c = 0; c < 16; c++)
+			{
+				sOut += '#';
+				AppendNumber(c);
+				sOut += ";2;";
+				AppendNumber(Rgb(c)[0] * 100 / 255);
+				sOut += ';';
+				AppendNumber(Rgb(c)[1] * 100 / 255);
+				sOut += ';';
+				AppendNumber(Rgb(c)[2] * 100 / 255);
+			}
+
+			int32_t nLastBand = ((nLastChangedRow + 1) * nPixelH - 1) / 6;
+
+			for (int32_t band = 0; band <= nLastBand; band++)
+			{
+				int32_t nRowFirst = (band * 6) / nPixelH;
+				int32_t nRowLast = std::min(band * 6 + 5, nHeightPx - 1) / nPixelH;
+
+				bool bChanged = false;
+
+				for (int32_t row = nRowFirst; row <= nRowLast; row++)
+					bChanged |= vecRowChanged[row] != 0;
+
+				if (bChanged)
+				{
+					// Six-bit column masks per colour, one per cell column
+					// since the nPixelW pixels of a cell are identical
+					std::fill(vecMasks.begin(), vecMasks.end(), 0);
+					uint16_t nUsed = 0;
+
+					for (int32_t k = 0; k < 6 && band * 6 + k < nHeightPx; k++)
+					{
+						const uint8_t* pRow = &vecPrev[((band * 6 + k) / nPixelH) * nCellsX];
+
+						for (int32_t x = 0; x < nCellsX; x++)
+						{
+							vecMasks[pRow[x] * nCellsX + x] |= 1 << k;
+							nUsed |= 1 << pRow[x];
+						}
+					}
+
+					bool bFirst = true;
+
+					for (int c = 0; c < 16; c++)
+					{
+						if (!(nUsed & (1 << c)))
+							continue;
+
+						if (!bFirst)
+							sOut += '$';
+
+						bFirst = false;
+
+						sOut += '#';
+						AppendNumber(c);
+
+						const uint8_t* pMasks = &vecMasks[c * nCellsX];
+
+						// Trailing empty columns needn't be sent
+						int32_t nEnd = nCellsX;
+						while (nEnd > 0 && pMasks[nEnd - 1] == 0)
+							nEnd--;
+
+						for (int32_t x = 0; x < nEnd;)
+						{
+							int32_t nRun = 1;
+							while (x + nRun < nEnd && pMasks[x + nRun] == pMasks[x])
+								nRun++;
+
+							char ch = (char)(63 + pMasks[x]);
+							int32_t nPixels = nRun * nPixelW;
+
+							if (nPixels > 3)
+							{
+								sOut += '!';
+								AppendNumber(nPixels);
+								sOut += ch;
+							}
+							else
+								sOut.append(nPixels, ch);
+
+							x += nRun;
+						}
+					}
+				}
+
+				if (band < nLastBand)
+					sOut += '-';
+			}
+
+			sOut += "\x1b\\";
+		}
+
+		// The first frame is transmitted once as a palette PNG with one
+		// pixel per cell and scaled by the terminal. After that, only runs
+		// of changed rows are sent and composited into the same image
+		void EncodeKitty()
+		{
+			for (int32_t y = 0; y < nCellsY;)
+			{
+				if (!vecRowChanged[y])
+				{
+					y++;
+					continue;
+				}
+
+				int32_t nFirst = y;
+
+				while (y < nCellsY && vecRowChanged[y])
+					y++;
+
+				EncodePng(nFirst, y - nFirst);
+
+				if (!bImageSent)
+				{
+					sOut += "\x1b[H\x1b_Ga=T,i=1,f=100,q=2,C=1";
+
+					if (nDisplayCols > 0 && nDisplayRows > 0)
+					{
+						sOut += ",c=";
+						AppendNumber(nDisplayCols);
+						sOut += ",r=";
+						AppendNumber(nDisplayRows);
+					}
+
+					bImageSent = true;
+				}
+				else
+				{
+					sOut += "\x1b_Ga=f,i=1,r=1,f=100,q=2,x=0,y=";
+					AppendNumber(nFirst);
+				}
+
+				AppendBase64Chunks();
+			}
+		}
+
+		// 4-bit palette PNG of cell rows [nFirst, nFirst + nCount), deflate
+		// in stored blocks since the point is re-use, not compression
+		void EncodePng(int32_t nFirst, int32_t nCount)
+		{
+			vecPng.clear();
+
+			const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+			vecPng.insert(vecPng.end(), signature, signature + 8);
+
+			size_t nChunk = BeginPngChunk("IHDR");
+			AppendBE32(nCellsX);
+			AppendBE32(nCount);
+			vecPng.push_back(4); // bit depth
+			vecPng.push_back(3); // indexed colour
+			vecPng.push_back(0);
+			vecPng.push_back(0);
+			vecPng.push_back(0);
+			EndPngChunk(nChunk);
+
+			nChunk = BeginPngChunk("PLTE");
+			for (int c = 0; c < 16; c++)
+				vecPng.insert(vecPng.end(), Rgb(c), Rgb(c) + 3);
+			EndPngChunk(nChunk);
+
+			int32_t nStride = 1 + (nCellsX + 1) / 2;
+			uint32_t nRawSize = nStride * nCount;
+
+			nChunk = BeginPngChunk("IDAT");
+			vecPng.push_back(0x78);
+			vecPng.push_back(0x01);
+
+			uint32_t a = 1, b = 0;
+			uint32_t nLeft = nRawSize;
+			uint32_t nBlock = 0;
+
+			for (int32_t y = 0; y < nCount; y++)
+			{
+				const uint8_t* pRow = &vecPrev[(nFirst + y) * nCellsX];
+
+				for (int32_t i = 0; i < nStride; i++)
+				{
+					if (nBlock == 0)
+					{
+						nBlock = std::min<uint32_t>(nLeft, 65535);
+						nLeft -= nBlock;
+
+						vecPng.push_back(nLeft == 0 ? 1 : 0);
+						vecPng.push_back(nBlock & 0xFF);
+						vecPng.push_back(nBlock >> 8);
+						vecPng.push_back(~nBlock & 0xFF);
+						vecPng.push_back((~nBlock >> 8) & 0xFF);
+					}
+
+					uint8_t byte = 0; // filter type 0 leads each row
+
+					if (i > 0)
+					{
+						int32_t x = (i - 1) * 2;
+						byte = pRow[x] << 4;
+
+						if (x + 1 < nCellsX)
+							byte |= pRow[x + 1];
+					}
+
+					vecPng.push_back(byte);
+					nBlock--;
+
+					a = (a + byte) % 65521;
+					b = (b + a) % 65521;
+				}
+			}
+
+			AppendBE32((b << 16) | a);
+			EndPngChunk(nChunk);
+
+			nChunk = BeginPngChunk("IEND");
+			EndPngChunk(nChunk);
+		}
+
+		size_t BeginPngChunk(const char* sType)
+		{
+			size_t nStart = vecPng.size();
+			AppendBE32(0);
+			vecPng.insert(vecPng.end(), sType, sType + 4);
+			return nStart;
+		}
+
+		void EndPngChunk(size_t nStart)
+		{
+			uint32_t nLength = (uint32_t)(vecPng.size() - nStart - 8);
+
+			vecPng[nStart + 0] = nLength >> 24;
+			vecPng[nStart + 1] = (nLength >> 16) & 0xFF;
+			vecPng[nStart + 2] = (nLength >> 8) & 0xFF;
+			vecPng[nStart + 3] = nLength & 0xFF;
+
+			AppendBE32(Crc32(&vecPng[nStart + 4], nLength + 4));
+		}
+
+		void AppendBE32(uint32_t n)
+		{
+			vecPng.push_back(n >> 24);
+			vecPng.push_back((n >> 16) & 0xFF);
+			vecPng.push_back((n >> 8) & 0xFF);
+			vecPng.push_back(n & 0xFF);
+		}
+
+		static uint32_t Crc32(const uint8_t* data, size_t size)
+		{
+			static uint32_t table[256];
+			static bool bTable = false;
+
+			if (!bTable)
+			{
+				for (uint32_t n = 0; n < 256; n++)
+				{
+					uint32_t c = n;
+
+					for (int k = 0; k < 8; k++)
+						c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+
+					table[n] = c;
+				}
+
+				bTable = true;
+			}
+
+			uint32_t crc = 0xFFFFFFFF;
+
+			for (size_t i = 0; i < size; i++)
+				crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+
+			return crc ^ 0xFFFFFFFF;
+		}
+
+		// Finishes the control data already in sOut with the PNG as base64,
+		// split into the 4096 byte chunks the protocol allows
+		void AppendBase64Chunks()
+		{
+			static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+			const size_t CHUNK = 3072; // becomes 4096 base64 characters
+			size_t nSize = vecPng.size();
+
+			for (size_t nStart = 0; nStart < nSize; nStart += CHUNK)
+			{
+				size_t nEnd = std::min(nStart + CHUNK, nSize);
+
+				if (nStart > 0)
+					sOut += "\x1b_G";
+
+				sOut += nStart > 0 ? "" : ",";
+				sOut += nEnd < nSize ? "m=1;" : "m=0;";
+
+				for (size_t i = nStart; i < nEnd; i += 3)
+				{
+					uint32_t n = vecPng[i] << 16;
+
+					if (i + 1 < nEnd) n |= vecPng[i + 1] << 8;
+					if (i + 2 < nEnd) n |= vecPng[i + 2];
+
+					sOut += digits[(n >> 18) & 0x3F];
+					sOut += digits[(n >> 12) & 0x3F];
+					sOut += i + 1 < nEnd ? digits[(n >> 6) & 0x3F] : '=';
+					sOut += i + 2 < nEnd ? digits[n & 0x3F] : '=';
+				}
+
+				sOut += "\x1b\\";
+			}
+		}
+
+		// Default console palette
+		static const uint8_t* Rgb(int32_t nColour)
+		{
+			static const uint8_t rgb[16][3] =
+			{
+				{ 0, 0, 0 }, { 0, 0, 128 }, { 0, 128, 0 }, { 0, 128, 128 },
+				{ 128, 0, 0 }, { 128, 0, 128 }, { 128, 128, 0 }, { 192, 192, 192 },
+				{ 128, 128, 128 }, { 0, 0, 255 }, { 0, 255, 0 }, { 0, 255, 255 },
+				{ 255, 0, 0 }, { 255, 0, 255 }, { 255, 255, 0 }, { 255, 255, 255 }
+			};
+
+			return rgb[nColour & 0xF];
+		}
+
+		// Console colour index to SGR foreground code
+		static int32_t AnsiColour(uint8_t nColour)
+		{
+			static const uint8_t codes[16] = { 30, 34, 32, 36, 31, 35, 33, 37, 90, 94, 92, 96, 91, 95, 93, 97 };
+			return codes[nColour & 0xF];
+		}
+
+		static uint8_t CellColour(const CHAR_INFO& c)
+		{
+			switch (c.Char.UnicodeChar)
+			{
+			case 0:
+			case L' ':
+			case PIXEL_QUARTER:
+				return (c.Attributes >> 4) & 0xF;
+
+			default:
+				return c.Attributes & 0xF;
+			}
+		}
+
+		static int16_t DecodeChar(uint8_t ch)
+		{
+			if (ch >= 'a' && ch <= 'z') return ch - 'a' + 'A';
+			if ((ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')) return ch;
+
+			switch (ch)
+			{
+			case ' ': return VK_SPACE;
+			case '\r': case '\n': return VK_RETURN;
+			case '\t': return VK_TAB;
+			case 0x1B: return VK_ESCAPE;
+			case 0x7F: case 0x08: return VK_BACK;
+			}
+
+			return 0;
+		}
+
+		static int16_t DecodeEscape(char cIntro, int32_t nParam, char cFinal)
+		{
+			switch (cFinal)
+			{
+			case 'A': return VK_UP;
+			case 'B': return VK_DOWN;
+			case 'C': return VK_RIGHT;
+			case 'D': return VK_LEFT;
+			case 'P': return VK_F1;
+			case 'Q': return VK_F2;
+			case 'R': return VK_F3;
+			case 'S': return VK_F4;
+			}
+
+			if (cIntro != '[' || cFinal != '~')
+				return 0;
+
+			switch (nParam)
+			{
+			case 3: return VK_DELETE;
+			case 11: return VK_F1;
+			case 12: return VK_F2;
+			case 13: return VK_F3;
+			case 14: return VK_F4;
+			case 15: return VK_F5;
+			case 17: return VK_F6;
+			case 18: return VK_F7;
+			case 19: return VK_F8;
+			case 20: return VK_F9;
+			case 21: return VK_F10;
+			case 23: return VK_F11;
+			case 24: return VK_F12;
+			}
+
+			return 0;
+		}
+
+		void AppendNumber(int32_t n)
+		{
+			char buf[12];
+			int32_t len = 0;
+
+			do
+			{
+				buf[len++] = '0' + n % 10;
+				n /= 10;
+			} while (n > 0);
+
+			while (len > 0)
+				sOut += buf[--len];
+		}
+
+		static void AppendUtf8(std::string& s, wchar_t c)
+		{
+			uint32_t u = (uint32_t)c;
+
+			if (u < 0x80)
+				s += (char)u;
+			else if (u < 0x800)
+			{
+				s += (char)(0xC0 | (u >> 6));
+				s += (char)(0x80 | (u & 0x3F));
+			}
+			else
+			{
+				s += (char)(0xE0 | ((u >> 12) & 0x0F));
+				s += (char)(0x80 | ((u >> 6) & 0x3F));
+				s += (char)(0x80 | (u & 0x3F));
+			}
+		}
+
+		static void Write(const char* data)
+		{
+			Write(data, std::strlen(data));
+		}
+
+		static void Write(const char* data, size_t size)
+		{
+			while (size > 0)
+			{
+				ssize_t n = write(STDOUT_FILENO, data, size);
+
+				if (n < 0)
+				{
+					if (errno == EINTR)
+						continue;
+
+					return;
+				}
+
+				data += n;
+				size -= n;
+			}
+		}
+	};
+#endif
+
+	// Renders into memory, replays scripted input and runs on a virtual
+	// clock, so engine apps can run unattended and as fast as the CPU allows
+	class PlatformHeadless : public Platform
+	{
+	public:
+		// Stops the app after nFrames frames (0 runs until OnUserUpdate
+		// returns false), each advancing the clock by fFrameTime seconds
+		PlatformHeadless(uint64_t nFrames = 0, float fFrameTime = 1.0f / 60.0f)
+		{
+			nMaxFrames = nFrames;
+			fStep = fFrameTime;
+		}
+
+	public:
+		struct KeyEvent
+		{
+			uint64_t nFrame;
+			int16_t nKey;
+			bool bDown;
+		};
+
+		// Applied at the start of frame nFrame, in the order added
+		void AddKeyEvent(uint64_t nFrame, int16_t nKey, bool bDown)
+		{
+			vecScript.push_back({ nFrame, nKey, bDown });
+			std::stable_sort(vecScript.begin(), vecScript.end(), [](const KeyEvent& a, const KeyEvent& b) { return a.nFrame < b.nFrame; });
+		}
+
+		const std::vector<CHAR_INFO>& GetCells() const { return vecCells; }
+		uint64_t GetFrameCount() const { return nFrame; }
+		const std::wstring& GetTitle() const { return sLastTitle; }
+
+		// What the mixer produced during the last frame, and in total
+		const std::vector<int16_t>& GetAudio() const { return vecAudio; }
+		uint64_t GetAudioFrames() const { return nAudioFrames; }
+
+	private:
+		std::vector<CHAR_INFO> vecCells;
+		int32_t nWidth = 0;
+
+		std::vector<KeyEvent> vecScript;
+		size_t nNextEvent = 0;
+
+		uint64_t nFrame = 0;
+		uint64_t nMaxFrames = 0;
+		float fStep = 1.0f / 60.0f;
+
+		SoundMixer* pAudioMixer = nullptr;
+		std::vector<int16_t> vecAudio;
+		uint64_t nAudioFrames = 0;
+
+		std::wstring sLastTitle;
+
+	public:
+		rcode Construct(int32_t width, int32_t height, int32_t, int32_t, const std::wstring&) override
+		{
+			nWidth = width;
+			vecCells.assign(width * height, CHAR_INFO{});
+
+			return { true, "Ok" };
+		}
+
+		void SetTitle(const std::wstring& sTitle) override
+		{
+			sLastTitle = sTitle;
+		}
+
+		void Present(const CHAR_INFO* pCells, int32_t width, int32_t height, const std::vector<SMALL_RECT>* pRegions) override
+		{
+			if (!pRegions)
+			{
+				std::memcpy(vecCells.data(), pCells, width * height * sizeof(CHAR_INFO));
+				return;
+			}
+
+			for (const SMALL_RECT& rect : *pRegions)
+				for (int y = rect.Top; y <= rect.Bottom; y++)
+					std::memcpy(&vecCells[y * width + rect.Left], &pCells[y * width + rect.Left], (rect.Right - rect.Left + 1) * sizeof(CHAR_INFO));
+		}
+
+		void PollInput(PlatformInput& input) override
+		{
+			int64_t nNow = int64_t(nFrame * fStep * 1000000.0);
+
+			for (; nNextEvent < vecScript.size() && vecScript[nNextEvent].nFrame <= nFrame; nNextEvent++)
+				input.vecEvents.push_back({ (int16_t)(vecScript[nNextEvent].nKey & 0xFF), vecScript[nNextEvent].bDown, nNow });
+
+			nFrame++;
+
+			if (nMaxFrames > 0 && nFrame >= nMaxFrames)
+				input.bQuit = true;
+
+			// Mixed on this thread, one frame's worth per frame
+			if (pAudioMixer)
+			{
+				pAudioMixer->Mix(vecAudio.data(), (int32_t)vecAudio.size() / SoundMixer::nChannels);
+				nAudioFrames += vecAudio.size() / SoundMixer::nChannels;
+			}
+		}
+
+		bool OpenAudio(SoundMixer* pMixer) override
+		{
+			pAudioMixer = pMixer;
+			vecAudio.assign(int32_t(fStep * SoundMixer::nSampleRate + 0.5f) * SoundMixer::nChannels, 0);
+
+			return true;
+		}
+
+		float GetElapsedTime() override
+		{
+			return fStep;
+		}
+
+		bool IsRealTime() const override
+		{
+			return false;
+		}
+	};
+
+	class ConsoleGameEngine
+	{
+	public:
+		ConsoleGameEngine()
+		{
+#ifdef _WIN32
+			platform.reset(new PlatformWin32Console());
+#else
+			platform.reset(new PlatformAnsiTerminal());
+#endif
+
+			sAppName = L"Undefined";
+			sFont = L"Consolas";
+		}
+
+		virtual ~ConsoleGameEngine()
+		{
+			delete[] screen;
+		}
+
+	public:
+		virtual bool OnUserCreate() = 0;
+		virtual bool OnUserUpdate(float fDeltaTime) = 0;
+
+		// Called once after the last OnUserUpdate() if OnUserCreate() succeeded
+		virtual bool OnUserDestroy() { return true; }
+
+		// Called with each batch of input as soon as it's polled, ahead of
+		// presenting the frame, for apps that hand input to another thread
+		// and shouldn't make it wait for a console write first
+		virtual void OnUserInput(const std::vector<InputEvent>&) {}
+
+		rcode ConstructConsole(int width = 120, int height = 40, int fontw = 4, int fonth = 4)
+		{
+			rcode rc;
+			rc.ok = false;
+
+			if (width <= 0 || height <= 0 || fontw <= 0 || fonth <= 0)
+			{
+				rc.info = "Invalid width or height";
+				return rc;
+			}
+
+			nScreenWidth = width;
+			nScreenHeight = height;
+
+			nFontW = fontw;
+			nFontH = fonth;
+
+			rc = platform->Construct(nScreenWidth, nScreenHeight, nFontW, nFontH, sFont);
+
+			if (!rc.ok)
+				return rc;
+
+			bAudio = platform->OpenAudio(&mixer);
+
+			screen = new CHAR_INFO[nScreenWidth * nScreenHeight];
+			memset(screen, 0, sizeof(CHAR_INFO) * nScreenWidth * nScreenHeight);
+
+			rc.ok = true;
+			rc.info = "Ok";
+			return rc;
+		}
+
+		// Takes ownership, call before ConstructConsole()
+		void SetPlatform(Platform* pPlatform)
+		{
+			platform.reset(pPlatform);
+		}
+
+		Platform* GetPlatform() const
+		{
+			return platform.get();
+		}
+
+		void Run()
+		{
+			bGameThreadActive = true;
+
+			std::thread t = std::thread(&def::ConsoleGameEngine::AppThread, this);
+			t.join();
+		}
+
+	public:
+		template <typename T>
+		void Draw(vec2d_basic<T> pos, int16_t c = 0x2588, int16_t col = 0x000F);
+		void Draw(int32_t x, int32_t y, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void DrawLine(vec2d_basic<T> pos1, vec2d_basic<T> pos2, int16_t c = 0x2588, int16_t col = 0x000F);
+		void DrawLine(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void DrawTriangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, vec2d_basic<T> pos3, int16_t c = 0x2588, int16_t col = 0x000F);
+		void DrawTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void FillTriangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, vec2d_basic<T> pos3, int16_t c = 0x2588, int16_t col = 0x000F);
+		void FillTriangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int32_t x3, int32_t y3, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void DrawRectangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, int16_t c = 0x2588, int16_t col = 0x000F);
+		void DrawRectangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void DrawRectangleS(vec2d_basic<T> pos, vec2d_basic<T> size, int16_t c = 0x2588, int16_t col = 0x000F);
+		void DrawRectangleS(int32_t x, int32_t y, int32_t size_x, int32_t size_y, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void FillRectangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, int16_t c = 0x2588, int16_t col = 0x000F);
+		void FillRectangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void FillRectangleS(vec2d_basic<T> pos, vec2d_basic<T> size, int16_t c = 0x2588, int16_t col = 0x000F);
+		void FillRectangleS(int32_t x, int32_t y, int32_t size_x, int32_t size_y, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void DrawCircle(vec2d_basic<T> pos, int32_t radius, int16_t c = 0x2588, int16_t col = 0x000F);
+		void DrawCircle(int32_t x, int32_t y, int32_t radius, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void FillCircle(vec2d_basic<T> pos, int32_t radius, int16_t c = 0x2588, int16_t col = 0x000F);
+		void FillCircle(int32_t x, int32_t y, int32_t radius, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void DrawSprite(vec2d_basic<T> pos, Sprite* sprite);
+		void DrawSprite(int32_t x, int32_t y, Sprite* sprite);
+
+		template <typename T>
+		void DrawPartialSprite(vec2d_basic<T> pos, vec2d_basic<T> fpos1, vec2d_basic<T> fpos2, Sprite* sprite);
+		void DrawPartialSprite(int32_t x, int32_t y, int32_t fx1, int32_t fy1, int32_t fx2, int32_t fy2, Sprite* sprite);
+
+		template <typename T>
+		void DrawPartialSpriteS(vec2d_basic<T> pos, vec2d_basic<T> fpos1, vec2d_basic<T> fpos2, Sprite* sprite);
+		void DrawPartialSpriteS(int32_t x, int32_t y, int32_t fx1, int32_t fy1, int32_t fx2, int32_t fy2, Sprite* sprite);
+
+		// Atlas sprites, or any other cells laid out like a Sprite's
+		void DrawSprite(int32_t x, int32_t y, const SpriteView& view);
+		void DrawPartialSprite(int32_t x, int32_t y, int32_t fx1, int32_t fy1, int32_t fx2, int32_t fy2, const SpriteView& view);
+
+		// Copies a w x h bitmap to the screen, each source pixel becoming an
+		// nScale x nScale block of c coloured through pPalette (2 entries for
+		// 1bpp, 256 for 8bpp). 1bpp rows are MSB first, nPitch is in bytes.
+		// With pScanlinePalette the last line of each block is coloured
+		// through that instead, for a CRT-style scanline
+		template <typename T>
+		void DrawBitmap(vec2d_basic<T> pos, vec2d_basic<T> size, const uint8_t* pBits, int32_t nPitch, const int16_t* pPalette, int32_t nBitsPerPixel = 8, int32_t nScale = 1, int16_t c = 0x2588, const int16_t* pScanlinePalette = nullptr);
+		void DrawBitmap(int32_t x, int32_t y, int32_t w, int32_t h, const uint8_t* pBits, int32_t nPitch, const int16_t* pPalette, int32_t nBitsPerPixel = 8, int32_t nScale = 1, int16_t c = 0x2588, const int16_t* pScanlinePalette = nullptr);
+
+		void DrawWireFrameModel(std::vector<std::pair<float, float>>& vecModelCoordinates, float x, float y, float r = 0.0f, float s = 1.0f, int16_t c = 0x2588, int16_t col = 0x000F);
+		void DrawWireFrameModel(const WireFrameModel& model, float x, float y, float r = 0.0f, float s = 1.0f, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		template <typename T>
+		void DrawString(vec2d_basic<T> pos, std::wstring text, int16_t col = 0x000F);
+		void DrawString(int32_t x, int32_t y, std::wstring text, int16_t col = 0x000F);
+
+		void Clear(int16_t c = 0x2588, int16_t col = 0x000F);
+
+		// Fills cells x1 to x2 of row y, clipped once for the whole run.
+		// The fill primitives are built on it
+		void FillSpan(int32_t x1, int32_t x2, int32_t y, int16_t c = 0x2588, int16_t col = 0x000F);
+
+		// With dirty regions enabled only rectangles passed to MarkDirty()
+		// during the frame are written to the console, and nothing at all
+		// if none were marked
+		void EnableDirtyRegions(bool bEnable = true);
+		void MarkDirty(int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+
+		// Decodes a .wav file once and returns a handle for StartSound(),
+		// or -1. Asking for the same file again returns the same handle
+		int32_t LoadSound(const std::wstring& sFilename);
+
+		// Starting a loaded sound touches neither the disk nor the allocator
+		bool StartSound(int32_t nSound, bool bLoop = false, float fVolume = 1.0f);
+		bool StopSound(int32_t nSound = -1); // -1 stops every sound
+
+		// LoadSound() and StartSound(), only the first call per file reads it
+		bool MakeSound(std::wstring sFilename, bool bLoop = false);
+		bool Focused();
+
+		template <typename T>
+		inline vec2d_basic<T> GetMouse() const;
+
+		inline int32_t GetMouseX() const;
+		inline int32_t GetMouseY() const;
+
+		inline KeyState GetMouse(int16_t button) const;
+		inline KeyState GetKey(int16_t key) const;
+
+		// Every key change since the previous OnUserUpdate(), in order
+		inline const std::vector<InputEvent>& GetInputEvents() const;
+
+		inline int32_t GetCharacter(bool bHeld = true, bool bPressed = false, bool bReleased = false);
+
+		inline int32_t GetScreenWidth() const;
+		inline int32_t GetScreenHeight() const;
+
+		template <typename T>
+		inline vec2d_basic<T> GetScreenSize() const;
 
 		inline float GetDeltaTime() const;
 
+		// Caps the frame rate, sleeping off what's left of each frame.
+		// 0 (the default) runs flat out, headless runs are never held back
+		void SetFrameRate(float fFramesPerSecond);
+		float GetFrameRate() const;
+
+		// Frame time percentiles along the bottom row, refreshed twice a
+		// second and only marked dirty when the text changes
+		void ShowFrameStats(bool bShow = true);
+
+		// Every frame since ConstructConsole()
+		const FrameTimeHistogram& GetFrameTimes() const;
+
 	private:
 		void AppThread()
 		{
@@ -634,104 +3082,84 @@ namespace def
 
 			if (bGameThreadActive)
 			{
-				auto tp1 = std::chrono::system_clock::now();
-				auto tp2 = std::chrono::system_clock::now();
-
 				for (int i = 0; i < 256; i++)
 					keys.push_back({ false, false, false });
 
+				input.vecEvents.reserve(64);
+				vecKeysChanged.reserve(64);
+
 				for (int i = 0; i < 5; i++)
 					mouse.push_back({ false, false, false });
 
+				// Once, a title per frame is a syscall (or bytes on the wire) per
+				// frame, the numbers it used to show are in the stats overlay
+				platform->SetTitle(L"github.com/defini7 - Consola Prod - " + sAppName);
+
 				while (bGameThreadActive)
 				{
-					tp2 = std::chrono::system_clock::now();
-					std::chrono::duration<float> elapsedTime = tp2 - tp1;
-					tp1 = tp2;
-					fDeltaTime = elapsedTime.count();
+					fDeltaTime = platform->GetElapsedTime();
 
-					wchar_t buffer_title[256];
-					swprintf_s(buffer_title, 256, L"github.com/defini7 - Consola Prod - %s - FPS: %3.2f", sAppName.c_str(), 1.0f / fDeltaTime);
-					SetConsoleTitleW(buffer_title);
+					int64_t nFrameUs = int64_t(fDeltaTime * 1000000.0f);
+					histFrameTimes.Record(nFrameUs);
+					histStatsWindow.Record(nFrameUs);
 
 					if (!OnUserUpdate(fDeltaTime))
 						bGameThreadActive = false;
 
-					INPUT_RECORD inBuf[32];
-					DWORD events = 0;
-					GetNumberOfConsoleInputEvents(hConsoleIn, &events);
-					if (events > 0)
-						ReadConsoleInputW(hConsoleIn, inBuf, events, &events);
-
-					for (DWORD i = 0; i < events; i++)
-					{
-						switch (inBuf[i].EventType)
-						{
-						case FOCUS_EVENT:
-							bFocused = inBuf[i].Event.FocusEvent.bSetFocus;
-							break;
-
-						case MOUSE_EVENT:
-						{
-							switch (inBuf[i].Event.MouseEvent.dwEventFlags)
-							{
-							case MOUSE_MOVED:
-							{
-								nMousePosX = inBuf[i].Event.MouseEvent.dwMousePosition.X;
-								nMousePosY = inBuf[i].Event.MouseEvent.dwMousePosition.Y;
-							}
-							break;
-
-							case 0:
-							{
-								for (int m = 0; m < 5; m++)
-									mouseNewState[m] = (inBuf[i].Event.MouseEvent.dwButtonState & (1 << m)) > 0;
-							}
-							break;
+					if (bFrameStats)
+						DrawFrameStats();
 
-							default:
-								break;
-							}
-						}
-						break;
+					input.vecEvents.clear();
+					platform->PollInput(input);
 
-						default:
-							break;
-						}
-					}
+					if (input.bQuit)
+						bGameThreadActive = false;
 
-					for (int i = 0; i < 256; i++)
+					nMousePosX = input.nMouseX;
+					nMousePosY = input.nMouseY;
+					bFocused = input.bFocused;
+
+					// Only keys with events (now or last frame) need touching
+					for (int16_t k : vecKeysChanged)
 					{
-						keyNewState[i] = GetAsyncKeyState(i);
+						keys[k].bPressed = false;
+						keys[k].bReleased = false;
+					}
 
-						keys[i].bPressed = false;
-						keys[i].bReleased = false;
+					vecKeysChanged.clear();
+
+					for (const InputEvent& e : input.vecEvents)
+					{
+						KeyState& key = keys[e.nKey & 0xFF];
 
-						if (keyNewState[i] != keyOldState[i])
+						if (e.bDown)
 						{
-							if (keyNewState[i] & 0x8000)
+							if (!key.bHeld)
 							{
-								keys[i].bPressed = !keys[i].bHeld;
-								keys[i].bHeld = true;
-							}
-							else
-							{
-								keys[i].bReleased = true;
-								keys[i].bHeld = false;
+								key.bPressed = true;
+								key.bHeld = true;
 							}
 						}
+						else if (key.bHeld)
+						{
+							key.bReleased = true;
+							key.bHeld = false;
+						}
 
-						keyOldState[i] = keyNewState[i];
+						vecKeysChanged.push_back(e.nKey & 0xFF);
 					}
 
+					if (!input.vecEvents.empty())
+						OnUserInput(input.vecEvents);
+
 					for (int m = 0; m < 5; m++)
 					{
 						mouse[m].bPressed = false;
 						mouse[m].bReleased = false;
 
-						if (mouseNewState[m] != mouseOldState[m])
+						if (input.mouse[m] != mouseOldState[m])
 						{
-							if (mouseNewState[m])
+							if (input.mouse[m])
 							{
 								mouse[m].bPressed = true;
 								mouse[m].bHeld = true;
@@ -743,11 +3171,79 @@ namespace def
 							}
 						}
 
-						mouseOldState[m] = mouseNewState[m];
+						mouseOldState[m] = input.mouse[m];
+					}
+
+					if (bDirtyRegions)
+					{
+						if (!vecDirtyRegions.empty())
+							platform->Present(screen, nScreenWidth, nScreenHeight, &vecDirtyRegions);
+
+						vecDirtyRegions.clear();
 					}
+					else
+						platform->Present(screen, nScreenWidth, nScreenHeight, nullptr);
 
-					WriteConsoleOutputW(hConsoleOut, screen, { (int16_t)nScreenWidth, (int16_t)nScreenHeight }, { 0,0 }, &rectWindow);
+					if (platform->IsRealTime())
+						pacer.Wait();
 				}
+
+				OnUserDestroy();
+			}
+		}
+
+		// The one loop every fill ends up in, 4 cells per SSE2 store
+		static void FillCells(CHAR_INFO* pCells, int32_t nCount, CHAR_INFO cell);
+
+		// Draws sprite cells [sx1, sx2) x [sy1, sy2) with the top left at
+		// x, y, clipped once and then a row at a time
+		void BlitSprite(int32_t x, int32_t y, const SpriteView& view, int32_t sx1, int32_t sy1, int32_t sx2, int32_t sy2);
+
+		// Copies the cells whose glyph isn't ' ', 4 at a time with SSE2
+		static void BlendCells(CHAR_INFO* pDst, const CHAR_INFO* pSrc, int32_t nCount);
+
+		// Rotates by (fCos, fSin), scales, translates and truncates n
+		// vertices to screen cells, 4 at a time with SSE2. Same operations
+		// in the same order either way, so both paths agree to the bit
+		static void TransformVertices(const float* pX, const float* pY, int32_t n, float fCos, float fSin, float s, float x, float y, int32_t* pOutX, int32_t* pOutY);
+
+		void DrawClosedPolygon(const int32_t* pX, const int32_t* pY, int32_t n, int16_t c, int16_t col);
+
+		void DrawFrameStats()
+		{
+			fStatsTimer += fDeltaTime;
+
+			if (fStatsTimer >= 0.5f && histStatsWindow.Count() > 0)
+			{
+				wchar_t sText[128];
+				swprintf_s(sText, 128, L" %5.1f fps  p50 %6.2f  p99 %6.2f  max %6.2f ms ",
+					histStatsWindow.Count() * 1000000.0f / std::max<int64_t>(histStatsWindow.Total(), 1),
+					histStatsWindow.Percentile(50.0f) / 1000.0f, histStatsWindow.Percentile(99.0f) / 1000.0f, histStatsWindow.Max() / 1000.0f);
+
+				sFrameStats = sText;
+
+				if (platform->GetBytesWritten() > 0)
+					sFrameStats += std::to_wstring(platform->GetBytesWritten()) + L" bytes/frame ";
+
+				// Erase whatever a longer previous text left behind
+				size_t nLength = sFrameStats.size();
+				sFrameStats.resize(std::max(nLength, nFrameStatsLength), L' ');
+				nFrameStatsLength = nLength;
+
+				histStatsWindow.Reset();
+				fStatsTimer = 0.0f;
+				bFrameStatsChanged = true;
+			}
+
+			int32_t nLength = std::min((int32_t)sFrameStats.size(), nScreenWidth);
+			DrawString(0, nScreenHeight - 1, sFrameStats.substr(0, nLength), FG_WHITE | BG_BLACK);
+
+			// Redrawn every frame in case the app drew over it, but only
+			// written out when it changed or the app marked that area anyway
+			if (bFrameStatsChanged && nLength > 0)
+			{
+				MarkDirty(0, nScreenHeight - 1, nLength - 1, nScreenHeight - 1);
+				bFrameStatsChanged = false;
 			}
 		}
 
@@ -757,20 +3253,26 @@ namespace def
 
 	private:
 		CHAR_INFO* screen = nullptr;
-		HANDLE hConsoleOut;
-		HANDLE hConsoleIn;
-		SMALL_RECT rectWindow;
-		HWND hWnd;
-		HDC hDC;
+
+		// Before the platform, whose audio thread uses them until it's destroyed
+		SoundMixer mixer;
+		std::vector<std::unique_ptr<Sound>> vecSounds;
+		std::map<std::wstring, int32_t> mapSoundFiles;
+		bool bAudio = false;
+
+		std::unique_ptr<Platform> platform;
+		PlatformInput input;
 
 		std::vector<KeyState> keys;
 		std::vector<KeyState> mouse;
 
-		int16_t keyOldState[256]{ 0 };
-		int16_t keyNewState[256]{ 0 };
+		// DrawWireFrameModel scratch, grown once and reused every call
+		WireFrameModel modelScratch;
+		std::vector<int32_t> vecVertexX;
+		std::vector<int32_t> vecVertexY;
 
+		std::vector<int16_t> vecKeysChanged;
 		bool mouseOldState[5] = { 0 };
-		bool mouseNewState[5] = { 0 };
 
 		int32_t nMousePosX;
 		int32_t nMousePosY;
@@ -785,16 +3287,101 @@ namespace def
 
 		bool bGameThreadActive;
 		bool bFocused;
+
+		bool bDirtyRegions = false;
+		std::vector<SMALL_RECT> vecDirtyRegions;
+
+		FramePacer pacer;
+		FrameTimeHistogram histFrameTimes;
+		FrameTimeHistogram histStatsWindow; // since the overlay last refreshed
+
+		bool bFrameStats = false;
+		bool bFrameStatsChanged = false;
+		float fStatsTimer = 0.0f;
+		std::wstring sFrameStats;
+		size_t nFrameStatsLength = 0;
 	};
 
+	int32_t ConsoleGameEngine::LoadSound(const std::wstring& sFilename)
+	{
+		auto it = mapSoundFiles.find(sFilename);
+
+		if (it != mapSoundFiles.end())
+			return it->second;
+
+		int32_t nSound = -1;
+		std::unique_ptr<Sound> pSound(new Sound);
+
+		if (pSound->LoadWav(sFilename))
+		{
+			vecSounds.push_back(std::move(pSound));
+			nSound = (int32_t)vecSounds.size() - 1;
+		}
+
+		// failures too, so a missing file isn't looked for on every call
+		mapSoundFiles[sFilename] = nSound;
+
+		return nSound;
+	}
+
+	bool ConsoleGameEngine::StartSound(int32_t nSound, bool bLoop, float fVolume)
+	{
+		if (!bAudio || nSound < 0 || nSound >= (int32_t)vecSounds.size())
+			return false;
+
+		return mixer.Play(vecSounds[nSound].get(), bLoop, fVolume);
+	}
+
+	bool ConsoleGameEngine::StopSound(int32_t nSound)
+	{
+		if (!bAudio || nSound >= (int32_t)vecSounds.size())
+			return false;
+
+		return mixer.Stop(nSound < 0 ? nullptr : vecSounds[nSound].get());
+	}
+
 	bool ConsoleGameEngine::MakeSound(std::wstring sFilename, bool bLoop)
 	{
-		DWORD f = SND_ASYNC | SND_FILENAME;
+		return StartSound(LoadSound(sFilename), bLoop);
+	}
+
+	void ConsoleGameEngine::SetFrameRate(float fFramesPerSecond)
+	{
+		pacer.SetRate(fFramesPerSecond);
+	}
+
+	float ConsoleGameEngine::GetFrameRate() const
+	{
+		return pacer.GetRate();
+	}
+
+	void ConsoleGameEngine::ShowFrameStats(bool bShow)
+	{
+		bFrameStats = bShow;
+	}
+
+	const FrameTimeHistogram& ConsoleGameEngine::GetFrameTimes() const
+	{
+		return histFrameTimes;
+	}
+
+	void ConsoleGameEngine::EnableDirtyRegions(bool bEnable)
+	{
+		bDirtyRegions = bEnable;
+		vecDirtyRegions.clear();
+	}
+
+	void ConsoleGameEngine::MarkDirty(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+	{
+		x1 = std::max(x1, 0);
+		y1 = std::max(y1, 0);
+		x2 = std::min(x2, nScreenWidth - 1);
+		y2 = std::min(y2, nScreenHeight - 1);
 
-		if (bLoop)
-			f |= SND_LOOP;
+		if (x1 > x2 || y1 > y2)
+			return;
 
-		return (bool)PlaySoundW(sFilename.c_str(), nullptr, f);
+		vecDirtyRegions.push_back({ (int16_t)x1, (int16_t)y1, (int16_t)x2, (int16_t)y2 });
 	}
 
 	bool ConsoleGameEngine::Focused()
@@ -805,12 +3392,27 @@ namespace def
 	template <typename T>
 	void ConsoleGameEngine::FillRectangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, int16_t c, int16_t col)
 	{
-		for (int i = pos1.x; i <= pos2.x; i++)
-			for (int j = pos1.y; j <= pos2.y; j++)
-			{
-				screen[j * nScreenWidth + i].Char.UnicodeChar = c;
-				screen[j * nScreenWidth + i].Attributes = col;
-			}
+		int32_t x1 = std::max((int32_t)pos1.x, 0);
+		int32_t y1 = std::max((int32_t)pos1.y, 0);
+		int32_t x2 = std::min((int32_t)pos2.x, nScreenWidth - 1);
+		int32_t y2 = std::min((int32_t)pos2.y, nScreenHeight - 1);
+
+		if (x1 > x2 || y1 > y2)
+			return;
+
+		CHAR_INFO cell;
+		cell.Char.UnicodeChar = c;
+		cell.Attributes = col;
+
+		// Full-width rows are contiguous, so they're one run
+		if (x1 == 0 && x2 == nScreenWidth - 1)
+		{
+			FillCells(&screen[y1 * nScreenWidth], (y2 - y1 + 1) * nScreenWidth, cell);
+			return;
+		}
+
+		for (int32_t y = y1; y <= y2; y++)
+			FillCells(&screen[y * nScreenWidth + x1], x2 - x1 + 1, cell);
 	}
 
 	void ConsoleGameEngine::FillRectangle(int32_t x1, int32_t y1, int32_t x2, int32_t y2, int16_t c, int16_t col)
@@ -879,11 +3481,7 @@ namespace def
 		int32_t y = radius;
 		int32_t p = 3 - 2 * radius;
 
-		auto drawline = [&](int32_t sx, int32_t ex, int32_t ny)
-		{
-			for (int i = sx; i <= ex; i++)
-				Draw(i, ny, c, col);
-		};
+		auto drawline = [&](int32_t sx, int32_t ex, int32_t ny) { FillSpan(sx, ex, ny, c, col); };
 
 		while (y >= x)
 		{
@@ -1025,7 +3623,7 @@ namespace def
 	template <typename T>
 	void ConsoleGameEngine::FillTriangle(vec2d_basic<T> pos1, vec2d_basic<T> pos2, vec2d_basic<T> pos3, int16_t c, int16_t col)
 	{
-		auto drawline = [&](int32_t sx, int32_t ex, int32_t ny) { for (int i = sx; i <= ex; i++) Draw(i, ny, c, col); };
+		auto drawline = [&](int32_t sx, int32_t ex, int32_t ny) { FillSpan(sx, ex, ny, c, col); };
 
 		int32_t t1x, t2x, y, minx, maxx, t1xp, t2xp;
 
@@ -1330,14 +3928,7 @@ namespace def
 		if (sprite == nullptr)
 			return;
 
-		for (int i = 0; i < sprite->nWidth; i++)
-		{
-			for (int j = 0; j < sprite->nHeight; j++)
-			{
-				if (sprite->GetGlyph(i, j) != L' ')
-					Draw(pos.x + i, pos.y + j, sprite->GetGlyph(i, j), sprite->GetColour(i, j));
-			}
-		}
+		BlitSprite((int32_t)pos.x, (int32_t)pos.y, sprite->GetView(), 0, 0, sprite->nWidth, sprite->nHeight);
 	}
 
 	void ConsoleGameEngine::DrawSprite(int32_t x, int32_t y, Sprite* sprite)
@@ -1351,14 +3942,7 @@ namespace def
 		if (sprite == nullptr || fpos1.x < 0 || fpos1.y < 0 || fpos2.x > sprite->nWidth || fpos2.y > sprite->nHeight)
 			return;
 
-		for (int i = fpos1.x, x = 0; i < fpos2.x; i++, x++)
-		{
-			for (int j = fpos1.y, y = 0; j < fpos2.y; j++, y++)
-			{
-				if (sprite->GetGlyph(i, j) != L' ')
-					Draw(pos.x + x, pos.y + y, sprite->GetGlyph(i, j), sprite->GetColour(i, j));
-			}
-		}
+		BlitSprite((int32_t)pos.x, (int32_t)pos.y, sprite->GetView(), (int32_t)fpos1.x, (int32_t)fpos1.y, (int32_t)fpos2.x, (int32_t)fpos2.y);
 	}
 
 	void ConsoleGameEngine::DrawPartialSprite(int32_t x, int32_t y, int32_t fx1, int32_t fy1, int32_t fx2, int32_t fy2, Sprite* sprite)
@@ -1377,43 +3961,315 @@ namespace def
 		DrawPartialSprite<int32_t>({ x, y }, { fx1, fy1 }, { fx1 + fx2, fy1 + fy2 }, sprite);
 	}
 
+	void ConsoleGameEngine::DrawSprite(int32_t x, int32_t y, const SpriteView& view)
+	{
+		if (view.pCells)
+			BlitSprite(x, y, view, 0, 0, view.nWidth, view.nHeight);
+	}
+
+	void ConsoleGameEngine::DrawPartialSprite(int32_t x, int32_t y, int32_t fx1, int32_t fy1, int32_t fx2, int32_t fy2, const SpriteView& view)
+	{
+		if (view.pCells == nullptr || fx1 < 0 || fy1 < 0 || fx2 > view.nWidth || fy2 > view.nHeight)
+			return;
+
+		BlitSprite(x, y, view, fx1, fy1, fx2, fy2);
+	}
+
+	void ConsoleGameEngine::BlitSprite(int32_t x, int32_t y, const SpriteView& view, int32_t sx1, int32_t sy1, int32_t sx2, int32_t sy2)
+	{
+		// Shrink the source rectangle to what lands on screen
+		if (x < 0) { sx1 -= x; x = 0; }
+		if (y < 0) { sy1 -= y; y = 0; }
+
+		sx2 = std::min(sx2, sx1 + nScreenWidth - x);
+		sy2 = std::min(sy2, sy1 + nScreenHeight - y);
+
+		if (sx1 >= sx2 || sy1 >= sy2)
+			return;
+
+		int32_t nSpan = sx2 - sx1;
+
+		for (int32_t sy = sy1; sy < sy2; sy++)
+		{
+			const CHAR_INFO* pSrc = view.pCells + sy * view.nWidth + sx1;
+			CHAR_INFO* pDst = &screen[(y + sy - sy1) * nScreenWidth + x];
+
+			if (view.bOpaque)
+				memcpy(pDst, pSrc, nSpan * sizeof(CHAR_INFO));
+			else
+				BlendCells(pDst, pSrc, nSpan);
+		}
+	}
+
+	void ConsoleGameEngine::BlendCells(CHAR_INFO* pDst, const CHAR_INFO* pSrc, int32_t nCount)
+	{
+		int32_t i = 0;
+
+#ifdef DEF_CGE_SSE2
+		static_assert(sizeof(CHAR_INFO) == 4, "a cell has to fill one 32-bit lane");
+
+		// The glyph is the low half of each lane
+		const __m128i vGlyph = _mm_set1_epi32(0xFFFF);
+		const __m128i vSpace = _mm_set1_epi32(L' ');
+
+		for (; i + 4 <= nCount; i += 4)
+		{
+			__m128i vSrc = _mm_loadu_si128((const __m128i*)(pSrc + i));
+			__m128i vDst = _mm_loadu_si128((const __m128i*)(pDst + i));
+			__m128i vKeep = _mm_cmpeq_epi32(_mm_and_si128(vSrc, vGlyph), vSpace);
+
+			_mm_storeu_si128((__m128i*)(pDst + i), _mm_or_si128(_mm_and_si128(vKeep, vDst), _mm_andnot_si128(vKeep, vSrc)));
+		}
+#endif
+
+		for (; i < nCount; i++)
+		{
+			if (pSrc[i].Char.UnicodeChar != L' ')
+				pDst[i] = pSrc[i];
+		}
+	}
+
+	template <typename T>
+	void ConsoleGameEngine::DrawBitmap(vec2d_basic<T> pos, vec2d_basic<T> size, const uint8_t* pBits, int32_t nPitch, const int16_t* pPalette, int32_t nBitsPerPixel, int32_t nScale, int16_t c, const int16_t* pScanlinePalette)
+	{
+		DrawBitmap((int32_t)pos.x, (int32_t)pos.y, (int32_t)size.x, (int32_t)size.y, pBits, nPitch, pPalette, nBitsPerPixel, nScale, c, pScanlinePalette);
+	}
+
+	void ConsoleGameEngine::DrawBitmap(int32_t x, int32_t y, int32_t w, int32_t h, const uint8_t* pBits, int32_t nPitch, const int16_t* pPalette, int32_t nBitsPerPixel, int32_t nScale, int16_t c, const int16_t* pScanlinePalette)
+	{
+		static_assert(sizeof(CHAR_INFO) == sizeof(uint32_t), "cells are expanded as 32-bit lanes");
+
+		if (pBits == nullptr || pPalette == nullptr || nScale <= 0 || (nBitsPerPixel != 1 && nBitsPerPixel != 8))
+			return;
+
+		// Clip once, everything below works on the visible rectangle
+		int32_t dx1 = std::max(x, 0);
+		int32_t dy1 = std::max(y, 0);
+		int32_t dx2 = std::min(x + w * nScale, nScreenWidth);
+		int32_t dy2 = std::min(y + h * nScale, nScreenHeight);
+
+		if (dx1 >= dx2 || dy1 >= dy2)
+			return;
+
+		CHAR_INFO lut[256];
+		CHAR_INFO lutScanline[256];
+		int32_t nColours = nBitsPerPixel == 1 ? 2 : 256;
+
+		// A block one line high would be all scanline
+		if (nScale == 1)
+			pScanlinePalette = nullptr;
+
+		for (int i = 0; i < nColours; i++)
+		{
+			lut[i].Char.UnicodeChar = c;
+			lut[i].Attributes = pPalette[i];
+
+			if (pScanlinePalette)
+			{
+				lutScanline[i].Char.UnicodeChar = c;
+				lutScanline[i].Attributes = pScanlinePalette[i];
+			}
+		}
+
+		int32_t nSpan = dx2 - dx1;
+
+		// At 1bpp one source byte becomes nByteCells cells, and each of
+		// those always tests the same bit of it, so the per-lane bit masks
+		// for a byte's worth of cells are built once here
+		const int32_t nMaxVectorScale = 16;
+		int32_t nByteCells = 8 * nScale;
+		bool bVectorBits = nBitsPerPixel == 1 && nScale <= nMaxVectorScale;
+
+#ifdef DEF_CGE_SSE2
+#ifdef __AVX2__
+		const int32_t nLanes = 8;
+		typedef __m256i vcell;
+#else
+		const int32_t nLanes = 4;
+		typedef __m128i vcell;
+#endif
+		vcell vMasks[8 * nMaxVectorScale / nLanes];
+
+		if (bVectorBits)
+		{
+			alignas(32) int32_t nMask[8 * nMaxVectorScale];
+
+			for (int32_t i = 0; i < nByteCells; i++)
+				nMask[i] = 0x80 >> (i / nScale);
+
+			for (int32_t g = 0; g < nByteCells / nLanes; g++)
+				std::memcpy(&vMasks[g], &nMask[g * nLanes], sizeof(vcell));
+		}
+#endif
+
+		// Expands the visible part of one source row into one screen line
+		auto expandLine = [&](const uint8_t* pRow, CHAR_INFO* pDst, const CHAR_INFO* lut)
+		{
+			int32_t dx = dx1;
+
+			if (bVectorBits)
+			{
+				auto cell = [&](int32_t dx) { int32_t sx = (dx - x) / nScale; return lut[(pRow[sx >> 3] >> (7 - (sx & 7))) & 1]; };
+
+				// Leading cells up to a source byte boundary
+				for (; dx < dx2 && (dx - x) % nByteCells != 0; dx++)
+					*pDst++ = cell(dx);
+
+#ifdef DEF_CGE_SSE2
+				// Broadcast the source byte, test each lane's bit and blend
+				// the two palette cells
+				uint32_t nOff, nOn;
+				std::memcpy(&nOff, lut, sizeof(CHAR_INFO));
+				std::memcpy(&nOn, lut + 1, sizeof(CHAR_INFO));
+
+#ifdef __AVX2__
+				const __m256i vOff = _mm256_set1_epi32((int)nOff);
+				const __m256i vOn = _mm256_set1_epi32((int)nOn);
+
+				for (; dx + nByteCells <= dx2; dx += nByteCells)
+				{
+					__m256i vByte = _mm256_set1_epi32(pRow[(dx - x) / nByteCells]);
+
+					for (int32_t g = 0; g < nByteCells / nLanes; g++, pDst += nLanes)
+					{
+						__m256i vBits = _mm256_cmpeq_epi32(_mm256_and_si256(vByte, vMasks[g]), vMasks[g]);
+						_mm256_storeu_si256((__m256i*)pDst, _mm256_blendv_epi8(vOff, vOn, vBits));
+					}
+				}
+#else
+				const __m128i vOff = _mm_set1_epi32((int)nOff);
+				const __m128i vOn = _mm_set1_epi32((int)nOn);
+
+				for (; dx + nByteCells <= dx2; dx += nByteCells)
+				{
+					__m128i vByte = _mm_set1_epi32(pRow[(dx - x) / nByteCells]);
+
+					for (int32_t g = 0; g < nByteCells / nLanes; g++, pDst += nLanes)
+					{
+						__m128i vBits = _mm_cmpeq_epi32(_mm_and_si128(vByte, vMasks[g]), vMasks[g]);
+						_mm_storeu_si128((__m128i*)pDst, _mm_or_si128(_mm_and_si128(vBits, vOn), _mm_andnot_si128(vBits, vOff)));
+					}
+				}
+#endif
+#endif
+
+				for (; dx < dx2; dx++)
+					*pDst++ = cell(dx);
+			}
+			else
+			{
+				int32_t sx = (dx1 - x) / nScale;
+
+				// The first source pixel may be partly clipped
+				int32_t nRun = nScale - (dx1 - x) % nScale;
+
+				while (dx < dx2)
+				{
+					uint8_t index = nBitsPerPixel == 1 ? (pRow[sx >> 3] >> (7 - (sx & 7))) & 1 : pRow[sx];
+					nRun = std::min(nRun, dx2 - dx);
+
+					std::fill_n(pDst, nRun, lut[index]);
+
+					pDst += nRun;
+					dx += nRun;
+					sx++;
+					nRun = nScale;
+				}
+			}
+		};
+
+		for (int32_t dy = dy1; dy < dy2;)
+		{
+			const uint8_t* pRow = pBits + (dy - y) / nScale * nPitch;
+			CHAR_INFO* pFirst = &screen[dy * nScreenWidth + dx1];
+
+			expandLine(pRow, pFirst, lut);
+
+			// The rest of this source row's block is a copy of the first
+			// line, apart from its last when that's a scanline
+			int32_t nRepeat = std::min(nScale - (dy - y) % nScale, dy2 - dy);
+			bool bScanline = pScanlinePalette && (dy + nRepeat - y) % nScale == 0;
+
+			for (int32_t r = 1; r < nRepeat - (bScanline ? 1 : 0); r++)
+				std::memcpy(pFirst + r * nScreenWidth, pFirst, nSpan * sizeof(CHAR_INFO));
+
+			if (bScanline)
+				expandLine(pRow, pFirst + (nRepeat - 1) * nScreenWidth, lutScanline);
+
+			dy += nRepeat;
+		}
+	}
+
 	void ConsoleGameEngine::DrawWireFrameModel(std::vector<std::pair<float, float>>& vecModelCoordinates, float x, float y, float r, float s, int16_t c, int16_t col)
 	{
 		// pair.first = x coordinate
 		// pair.second = y coordinate
+		modelScratch.vecX.clear();
+		modelScratch.vecY.clear();
 
-		// Create translated model vector of coordinate pairs
-		std::vector<std::pair<float, float>> vecTransformedCoordinates;
-		int32_t verts = vecModelCoordinates.size();
-		vecTransformedCoordinates.resize(verts);
+		for (const auto& p : vecModelCoordinates)
+			modelScratch.Add(p.first, p.second);
 
-		// Rotate
-		for (int i = 0; i < verts; i++)
-		{
-			vecTransformedCoordinates[i].first = vecModelCoordinates[i].first * cosf(r) - vecModelCoordinates[i].second * sinf(r);
-			vecTransformedCoordinates[i].second = vecModelCoordinates[i].first * sinf(r) + vecModelCoordinates[i].second * cosf(r);
-		}
+		DrawWireFrameModel(modelScratch, x, y, r, s, c, col);
+	}
+
+	void ConsoleGameEngine::DrawWireFrameModel(const WireFrameModel& model, float x, float y, float r, float s, int16_t c, int16_t col)
+	{
+		int32_t verts = (int32_t)model.Size();
+
+		if (verts == 0)
+			return;
+
+		vecVertexX.resize(verts);
+		vecVertexY.resize(verts);
+
+		TransformVertices(model.vecX.data(), model.vecY.data(), verts, cosf(r), sinf(r), s, x, y, vecVertexX.data(), vecVertexY.data());
+		DrawClosedPolygon(vecVertexX.data(), vecVertexY.data(), verts, c, col);
+	}
+
+	void ConsoleGameEngine::TransformVertices(const float* pX, const float* pY, int32_t n, float fCos, float fSin, float s, float x, float y, int32_t* pOutX, int32_t* pOutY)
+	{
+		int32_t i = 0;
 
-		// Scale
-		for (int i = 0; i < verts; i++)
+#ifdef DEF_CGE_SSE2
+		__m128 vCos = _mm_set1_ps(fCos);
+		__m128 vSin = _mm_set1_ps(fSin);
+		__m128 vScale = _mm_set1_ps(s);
+		__m128 vX = _mm_set1_ps(x);
+		__m128 vY = _mm_set1_ps(y);
+
+		for (; i + 4 <= n; i += 4)
 		{
-			vecTransformedCoordinates[i].first = vecTransformedCoordinates[i].first * s;
-			vecTransformedCoordinates[i].second = vecTransformedCoordinates[i].second * s;
+			__m128 mx = _mm_loadu_ps(pX + i);
+			__m128 my = _mm_loadu_ps(pY + i);
+
+			__m128 rx = _mm_sub_ps(_mm_mul_ps(mx, vCos), _mm_mul_ps(my, vSin));
+			__m128 ry = _mm_add_ps(_mm_mul_ps(mx, vSin), _mm_mul_ps(my, vCos));
+
+			rx = _mm_add_ps(_mm_mul_ps(rx, vScale), vX);
+			ry = _mm_add_ps(_mm_mul_ps(ry, vScale), vY);
+
+			_mm_storeu_si128((__m128i*)(pOutX + i), _mm_cvttps_epi32(rx));
+			_mm_storeu_si128((__m128i*)(pOutY + i), _mm_cvttps_epi32(ry));
 		}
+#endif
 
-		// Translate
-		for (int i = 0; i < verts; i++)
+		for (; i < n; i++)
 		{
-			vecTransformedCoordinates[i].first = vecTransformedCoordinates[i].first + x;
-			vecTransformedCoordinates[i].second = vecTransformedCoordinates[i].second + y;
+			float rx = pX[i] * fCos - pY[i] * fSin;
+			float ry = pX[i] * fSin + pY[i] * fCos;
+
+			pOutX[i] = (int32_t)(rx * s + x);
+			pOutY[i] = (int32_t)(ry * s + y);
 		}
+	}
 
-		// Draw Closed Polygon
-		for (int i = 0; i < verts + 1; i++)
+	void ConsoleGameEngine::DrawClosedPolygon(const int32_t* pX, const int32_t* pY, int32_t n, int16_t c, int16_t col)
+	{
+		for (int32_t i = 0; i < n; i++)
 		{
-			int32_t j = (i + 1);
-			DrawLine((int32_t)vecTransformedCoordinates[i % verts].first, (int32_t)vecTransformedCoordinates[i % verts].second,
-				(int32_t)vecTransformedCoordinates[j % verts].first, (int32_t)vecTransformedCoordinates[j % verts].second, c, col);
+			int32_t j = (i + 1 == n) ? 0 : i + 1;
+			DrawLine(pX[i], pY[i], pX[j], pY[j], c, col);
 		}
 	}
 
@@ -1437,6 +4293,52 @@ namespace def
 		FillRectangle(0, 0, nScreenWidth - 1, nScreenHeight - 1, c, col);
 	}
 
+	void ConsoleGameEngine::FillSpan(int32_t x1, int32_t x2, int32_t y, int16_t c, int16_t col)
+	{
+		if (y < 0 || y >= nScreenHeight)
+			return;
+
+		x1 = std::max(x1, 0);
+		x2 = std::min(x2, nScreenWidth - 1);
+
+		if (x1 > x2)
+			return;
+
+		CHAR_INFO cell;
+		cell.Char.UnicodeChar = c;
+		cell.Attributes = col;
+
+		FillCells(&screen[y * nScreenWidth + x1], x2 - x1 + 1, cell);
+	}
+
+	void ConsoleGameEngine::FillCells(CHAR_INFO* pCells, int32_t nCount, CHAR_INFO cell)
+	{
+		int32_t i = 0;
+
+#ifdef DEF_CGE_SSE2
+		static_assert(sizeof(CHAR_INFO) == 4, "a cell has to fill one 32-bit lane");
+
+		uint32_t nCell;
+		memcpy(&nCell, &cell, sizeof(nCell));
+
+		const __m128i vCells = _mm_set1_epi32((int32_t)nCell);
+
+		for (; i + 16 <= nCount; i += 16)
+		{
+			_mm_storeu_si128((__m128i*)(pCells + i), vCells);
+			_mm_storeu_si128((__m128i*)(pCells + i + 4), vCells);
+			_mm_storeu_si128((__m128i*)(pCells + i + 8), vCells);
+			_mm_storeu_si128((__m128i*)(pCells + i + 12), vCells);
+		}
+
+		for (; i + 4 <= nCount; i += 4)
+			_mm_storeu_si128((__m128i*)(pCells + i), vCells);
+#endif
+
+		for (; i < nCount; i++)
+			pCells[i] = cell;
+	}
+
 	template <typename T>
 	inline vec2d_basic<T> ConsoleGameEngine::GetMouse() const
 	{
@@ -1463,6 +4365,11 @@ namespace def
 		return keys[key];
 	}
 
+	inline const std::vector<InputEvent>& ConsoleGameEngine::GetInputEvents() const
+	{
+		return input.vecEvents;
+	}
+
 	inline int32_t ConsoleGameEngine::GetScreenWidth() const
 	{
 		return nScreenWidth;
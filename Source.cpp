@@ -1,132 +1,845 @@
 #include <iostream>
+#include <sstream>
+#include <cstring>
+#include <thread>
+#include <chrono>
 
 #include "chip8.h"
+#include "chip8_audio.h"
+#include "chip8_capture.h"
+#include "chip8_shm.h"
+#include "triple_buffer.h"
 
 #include "ConsoleGameEngine.h"
 
 using namespace def;
 
-bool PlaySoundWrap()
+// Host key for each CHIP-8 key, in keypad order
+//   1 2 3 C        1 2 3 K
+//   4 5 6 D   <-   Q W E R
+//   7 8 9 E        A S D F
+//   A 0 B F        Z X C V
+static const int16_t nKeypadKeys[16] =
 {
-	return (bool)PlaySoundW(L"beep.wav", nullptr, SND_ASYNC | SND_FILENAME);
-}
+	L'X', L'1', L'2', L'3', L'Q', L'W', L'E', L'A',
+	L'S', L'D', L'Z', L'C', L'K', L'R', L'F', L'V'
+};
+
+// What the emulator thread hands to the presenter
+struct Frame
+{
+	uint8_t bits[32][8]; // 64x32 display, 1bpp, MSB is the leftmost pixel
+	float fSpeed = 1.0f; // emulated frames per second relative to 60
+};
+
+// How the presenter scales the display up to the console
+enum class ScaleFilter
+{
+	Nearest,
+	Scale2x // EPX, rounds off diagonals, then nearest for the rest
+};
 
 class Example : public def::ConsoleGameEngine
 {
 public:
-	Example()
+	Example(const std::string& sRom, const std::string& sWav, bool bLateLatch, int32_t nRunAheadFrames)
 	{
 		sAppName = L"Chip8 Emulator";
+		sRomFile = sRom;
+		sWavFile = sWav;
+
+		emu.late_latch = bLateLatch;
+		nRunAhead = nRunAheadFrames;
+
+		for (int32_t k = 0; k < 256; k++)
+			nHostToKeypad[k] = -1;
+
+		for (int32_t k = 0; k < 16; k++)
+			nHostToKeypad[nKeypadKeys[k]] = k;
+	}
+
+	// Before ConstructConsole(), which should be given DisplaySize().
+	// Scale2x needs an even scale and falls back to nearest otherwise
+	void SetScaling(int32_t nNewScale, ScaleFilter newFilter, bool bNewScanlines)
+	{
+		nScale = std::max(nNewScale, 1);
+		filter = (newFilter == ScaleFilter::Scale2x && nScale % 2 == 0) ? newFilter : ScaleFilter::Nearest;
+		bScanlines = bNewScanlines;
+	}
+
+	// Records every emulated frame to a .y4m, .gif or numbered .png files,
+	// nScale times the display's size
+	void SetCapture(const std::string& sFile, int32_t nScale)
+	{
+		sCaptureFile = sFile;
+		nCaptureScale = nScale;
+	}
+
+	// Publishes every emulated frame to a shared-memory ring other
+	// processes can watch, see chip8_shm.h
+	void SetFrameExport(const std::string& sName)
+	{
+		sExportName = sName;
+	}
+
+	vi2d DisplaySize() const
+	{
+		return { emu.display_width * nScale, emu.display_height * nScale };
+	}
+
+	void PrintStats(std::ostream& os)
+	{
+		os << "cycles: " << emu.cycles << '\n';
+		os << "skipped cycles: " << emu.skipped_cycles << '\n';
+		os << "published frames: " << frames.published << '\n';
+		os << "dropped frames: " << frames.dropped << '\n';
+		os << "duplicated frames: " << frames.duplicated << '\n';
+		os << "unchanged frames: " << nUnchangedFrames << '\n';
+		os << "audio samples played: " << audio.samples_played << '\n';
+		os << "audio underruns: " << audio.underruns << '\n';
+		os << "audio dropped samples: " << audio.dropped_samples << '\n';
+		os << "audio latency: " << audio.average_latency_ms() << " ms avg, " << audio.max_latency_ms() << " ms max\n";
+		os << "input latency: " << nInputLatencyCount << " samples, "
+			<< (nInputLatencyCount ? nInputLatencyTotalUs / nInputLatencyCount / 1000.0f : 0.0f) << " ms avg, "
+			<< nInputLatencyMaxUs / 1000.0f << " ms max\n";
+
+		const FrameTimeHistogram& hist = GetFrameTimes();
+		os << "presented frame time: " << hist.Percentile(50.0f) / 1000.0f << " ms p50, "
+			<< hist.Percentile(99.0f) / 1000.0f << " ms p99, " << hist.Max() / 1000.0f << " ms max\n";
+
+		if (!sCaptureFile.empty())
+		{
+			if (!sCaptureError.empty())
+				os << "capture: " << sCaptureError << '\n';
+			else
+			{
+				float fEncodeSeconds = capture.encode_ns / 1e9f;
+
+				os << "capture: " << capture.frames << " frames, " << capture.distinct_frames << " distinct, "
+					<< capture.dropped_frames << " dropped, queue high water " << capture.queue_high_water
+					<< " of " << capture.queue_capacity() << '\n';
+				os << "capture encode: " << capture.encoded_frames << " frames, " << capture.bytes_written << " bytes in "
+					<< fEncodeSeconds * 1000.0f << " ms (" << (fEncodeSeconds > 0.0f ? capture.encoded_frames / fEncodeSeconds : 0.0f)
+					<< " frames/s, " << (fEncodeSeconds > 0.0f ? capture.bytes_written / fEncodeSeconds / 1e6f : 0.0f) << " MB/s)\n";
+			}
+		}
+
+		if (!sExportName.empty())
+		{
+			if (!sExportError.empty())
+				os << "frame export: " << sExportError << '\n';
+			else
+				os << "frame export: " << shm.published << " frames to " << sExportName << '\n';
+		}
+
+		if (nRunAhead > 0)
+		{
+			os << "run-ahead: " << nRunAhead << " frames, " << nRunAheadFrames << " speculative frames, "
+				<< (nRunAheadFrames ? (float)nRunAheadNs / nRunAheadFrames / 1000.0f : 0.0f) << " us each ("
+				<< (nRunAheadCalls ? (float)nRunAheadStateNs / nRunAheadCalls / 1000.0f : 0.0f) << " us save/load per publish)\n";
+		}
 	}
 
 protected:
 	bool OnUserCreate() override
 	{
-		if (!emu.load_rom("roms/invaders.ch8"))
+		if (!emu.load_rom(sRomFile))
 			return false;
 
-		emu.set_audio(PlaySoundWrap);
+		bool bRealTime = GetPlatform()->IsRealTime();
+
+		// A real-time run plays the buzzer (or records what it would have
+		// played), a headless one renders it as fast as the core runs
+		audio_sink* pSink;
+
+		if (!sWavFile.empty())
+			pSink = new wav_audio_sink(sWavFile);
+#ifdef _WIN32
+		else if (bRealTime)
+			pSink = new waveout_audio_sink();
+#endif
+		else
+			pSink = new null_audio_sink();
+
+		if (!audio.start(pSink, bRealTime))
+			audio.start(new null_audio_sink(), bRealTime);
+
+		emu.set_audio(chip8_audio::tone_handler, &audio);
+
+		if (!sCaptureFile.empty())
+		{
+			auto bEndsWith = [&](const char* sExt) { return sCaptureFile.size() >= strlen(sExt) && sCaptureFile.compare(sCaptureFile.size() - strlen(sExt), std::string::npos, sExt) == 0; };
+
+			video_sink* pVideo;
+
+			if (bEndsWith(".y4m"))
+				pVideo = new y4m_video_sink(sCaptureFile, nCaptureScale);
+			else if (bEndsWith(".png"))
+				pVideo = new png_video_sink(sCaptureFile, nCaptureScale);
+			else
+				pVideo = new gif_video_sink(sCaptureFile, nCaptureScale);
+
+			// Like the audio, a real-time run can't be held up by it
+			if (!capture.start(pVideo, bRealTime))
+				sCaptureError = "could not open " + sCaptureFile;
+		}
+
+		if (!sExportName.empty() && !shm.open(sExportName))
+			sExportError = "could not create " + sExportName;
+
+		EnableDirtyRegions();
+
+		nBitPalette[0] = FG_WHITE | BG_WHITE;
+		nBitPalette[1] = FG_BLACK | BG_BLACK;
+
+		nScanlinePalette[0] = FG_GREY | BG_GREY;
+		nScanlinePalette[1] = FG_BLACK | BG_BLACK;
+
+		// The virtual clock of a headless run can't pace a second thread,
+		// so there the core stays on this one and stays deterministic
+		if (bRealTime)
+		{
+			bEmulatorRunning = true;
+			tEmulator = std::thread(&Example::EmulatorThread, this);
+		}
 
 		return true;
 	}
 
+	// Straight to the core's snapshot, without waiting for this frame's
+	// console write. Work scales with key events, nothing is polled per key
+	void OnUserInput(const std::vector<InputEvent>& vecEvents) override
+	{
+		for (const InputEvent& e : vecEvents)
+		{
+			int32_t nKey = nHostToKeypad[e.nKey & 0xFF];
+
+			if (nKey < 0)
+				continue;
+
+			uint16_t nMask = e.bDown ? (nKeypad | (1 << nKey)) : (nKeypad & ~(1 << nKey));
+
+			if (nMask != nKeypad)
+			{
+				nKeypad = nMask;
+				emu.set_keys(nKeypad, e.nTime);
+			}
+		}
+	}
+
 	bool OnUserUpdate(float fDeltaTime) override
 	{
-		int32_t key = -1;
-
-		if (GetKey(L'X').bPressed) key = 0;
-		if (GetKey(L'1').bPressed) key = 1;
-		if (GetKey(L'2').bPressed) key = 2;
-		if (GetKey(L'3').bPressed) key = 3;
-		if (GetKey(L'Q').bPressed) key = 4;
-		if (GetKey(L'W').bPressed) key = 5;
-		if (GetKey(L'E').bPressed) key = 6;
-		if (GetKey(L'A').bPressed) key = 7;
-		if (GetKey(L'S').bPressed) key = 8;
-		if (GetKey(L'D').bPressed) key = 9;
-		if (GetKey(L'Z').bPressed) key = 10;
-		if (GetKey(L'C').bPressed) key = 11;
-		if (GetKey(L'K').bPressed) key = 12;
-		if (GetKey(L'R').bPressed) key = 13;
-		if (GetKey(L'F').bPressed) key = 14;
-		if (GetKey(L'V').bPressed) key = 15;
-
-		if (key != -1)
-			emu.press_key(key);
-
-		key = -1;
-
-		if (GetKey(L'X').bReleased) key = 0;
-		if (GetKey(L'K').bReleased) key = 1;
-		if (GetKey(L'K').bReleased) key = 2;
-		if (GetKey(L'K').bReleased) key = 3;
-		if (GetKey(L'Q').bReleased) key = 4;
-		if (GetKey(L'W').bReleased) key = 5;
-		if (GetKey(L'E').bReleased) key = 6;
-		if (GetKey(L'A').bReleased) key = 7;
-		if (GetKey(L'S').bReleased) key = 8;
-		if (GetKey(L'D').bReleased) key = 9;
-		if (GetKey(L'Z').bReleased) key = 10;
-		if (GetKey(L'C').bReleased) key = 11;
-		if (GetKey(L'K').bReleased) key = 12;
-		if (GetKey(L'R').bReleased) key = 13;
-		if (GetKey(L'F').bReleased) key = 14;
-		if (GetKey(L'V').bReleased) key = 15;
-
-		if (key != -1)
-			emu.release_key(key);
-
-		emu.decrease_timers();
-
-		emu.next_opcode();
-
-		switch (emu.opcode & 0xF000)
-		{
-		case 0x0000: emu.decode_opcode_0(); break;
-		case 0x1000: emu.op_1NNN();			break;
-		case 0x2000: emu.op_2NNN();			break;
-		case 0x3000: emu.op_3XNN();			break;
-		case 0x4000: emu.op_4XNN();			break;
-		case 0x5000: emu.op_5XY0();			break;
-		case 0x6000: emu.op_6XNN();			break;
-		case 0x7000: emu.op_7XNN();			break;
-		case 0x8000: emu.decode_opcode_8(); break;
-		case 0x9000: emu.op_9XY0();			break;
-		case 0xA000: emu.op_ANNN();			break;
-		case 0xB000: emu.op_BNNN();			break;
-		case 0xC000: emu.op_CXNN();			break;
-		case 0xD000: emu.op_DXYN();			break;
-		case 0xE000: emu.decode_opcode_e(); break;
-		case 0xF000: emu.decode_opcode_f(); break;
-		}
-
-		for (int x = 0; x < emu.screen_width; x++)
-			for (int y = 0; y < emu.screen_height; y++)
+		// F1 toggles turbo, F2 cycles its speed (0 is unthrottled)
+		if (GetKey(VK_F1).bPressed)
+		{
+			bTurbo = !bTurbo;
+
+			// repaint what the speed readout covered
+			bForceRedraw = true;
+		}
+
+		if (GetKey(VK_F2).bPressed)
+			nTurboSpeed = (nTurboSpeed == 0) ? 2 : (nTurboSpeed >= 16 ? 0 : nTurboSpeed * 2);
+
+		if (!tEmulator.joinable())
+		{
+			// The headless clock is virtual, and so are its event times
+			dVirtualTime += fDeltaTime;
+
+			if (Emulate(fDeltaTime) > 0)
+				PublishFrame();
+
+			TrackInputLatency(int64_t(dVirtualTime * 1000000.0));
+		}
+
+		// Paced, the engine already sleeps between frames. Unpaced, give
+		// the core the CPU until it has something new rather than spinning
+		// on the buffer, but no longer than a frame, so input is still
+		// polled and a stalled core counts as duplicated frames
+		if (tEmulator.joinable() && GetFrameRate() == 0.0f)
+			frames.wait_for_publish(std::chrono::duration<float>(FRAME_TIME));
+
+		if (frames.acquire())
+			PresentFrame();
+
+		return true;
+	}
+
+	bool OnUserDestroy() override
+	{
+		if (tEmulator.joinable())
+		{
+			// It may be asleep until the next key
+			bEmulatorRunning = false;
+			emu.interrupt_wait();
+			tEmulator.join();
+		}
+
+		audio.stop();
+		capture.stop();
+		shm.close();
+
+		return true;
+	}
+
+private:
+	// Runs the core in real time and publishes every frame it finishes,
+	// so a slow console write never holds up emulation
+	void EmulatorThread()
+	{
+		auto tLast = std::chrono::steady_clock::now();
+
+		while (bEmulatorRunning)
+		{
+			auto tNow = std::chrono::steady_clock::now();
+			float fElapsed = std::chrono::duration<float>(tNow - tLast).count();
+			tLast = tNow;
+
+			if (Emulate(fElapsed) > 0)
+				PublishFrame();
+
+			TrackInputLatency(std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+
+			// Nothing changes until a key completes the FX0A, so sleep on it
+			// instead of spinning through identical frames. With the timers
+			// stopped there isn't even a tick to run, so sleep until the key,
+			// and don't make up the time spent asleep afterwards
+			if (emu.waiting_for_key && emu.delay_timer == 0 && emu.sound_timer == 0)
+			{
+				emu.wait_for_key(-1);
+				tLast = std::chrono::steady_clock::now();
+			}
+			else if (emu.waiting_for_key)
+				emu.wait_for_key(int32_t(FRAME_TIME * 1000.0f));
+			else if (!bTurbo || nTurboSpeed != 0)
+			{
+				// Wake when the accumulator next reaches a whole frame, a fixed
+				// FRAME_TIME from now would sometimes land just short of it
+				// and leave the audio without a frame for twice as long
+				float fSpeed = bTurbo ? (float)nTurboSpeed : 1.0f;
+				float fWait = std::max(FRAME_TIME - fAccumulator, 0.0f) / fSpeed;
+
+				std::this_thread::sleep_until(tNow + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<float>(fWait)));
+			}
+		}
+	}
+
+	// Hands the display to the capture and the frame export once the core
+	// has finished nTicks more frames
+	void FrameDone(uint32_t nTicks = 1)
+	{
+		nFramesEmulated += nTicks;
+		capture.frame(emu.display, nTicks);
+
+		if (shm.active())
+		{
+			chip8_shm_frame f;
+			f.frame = nFramesEmulated;
+			f.cycles = emu.cycles;
+			f.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+			f.ticks = nTicks;
+			f.keys = emu.key_mask;
+			f.flags = (emu.tone_on ? shm_flag_sound : 0) | (emu.waiting_for_key ? shm_flag_waiting : 0);
+			memcpy(f.rows, emu.display, sizeof(f.rows));
+
+			shm.publish(f);
+		}
+	}
+
+	// Advances the core by fElapsed seconds of host time, returns the
+	// number of frames emulated
+	int32_t Emulate(float fElapsed)
+	{
+		int32_t nFrames = 0;
+		int32_t nSpeed = nTurboSpeed;
+
+		if (bTurbo && nSpeed == 0)
+		{
+			// Unthrottled: emulate as fast as possible and only publish
+			// every nTurboFrameSkip-th emulated frame
+			for (int32_t f = 0; f < nTurboFrameSkip; f++)
 			{
-				Draw(
-					x, y, PIXEL_SOLID,
-					(emu.screen[y * emu.screen_width + x] > 125) ? (FG_WHITE | BG_WHITE) : (FG_BLACK | BG_BLACK)
+				int32_t nSkipped = emu.skip_frames(nTurboFrameSkip - f);
+
+				if (nSkipped > 0)
+				{
+					f += nSkipped - 1;
+					FrameDone(nSkipped);
+				}
+				else
+				{
+					emu.run_frame();
+					FrameDone();
+				}
+			}
+
+			nFrames = nTurboFrameSkip;
+		}
+		else
+		{
+			// Run the core at 60 timer ticks per second (times the turbo
+			// multiplier) regardless of how fast the console redraws
+			float fSpeed = bTurbo ? (float)nSpeed : 1.0f;
+			fAccumulator = std::min(fAccumulator + fElapsed * fSpeed, 0.25f * fSpeed);
+
+			while (fAccumulator >= FRAME_TIME)
+			{
+				emu.run_frame();
+				FrameDone();
+				fAccumulator -= FRAME_TIME;
+				nFrames++;
+			}
+		}
+
+		nSpeedFrames += nFrames;
+		fSpeedTimer += fElapsed;
+
+		if (fSpeedTimer >= 0.5f)
+		{
+			fAchievedSpeed = (float)nSpeedFrames * FRAME_TIME / fSpeedTimer;
+			nSpeedFrames = 0;
+			fSpeedTimer = 0.0f;
+		}
+
+		audio.render(emu.cycles);
+
+		return nFrames;
+	}
+
+	// Turns the core's first draw after a key change into a sample of the
+	// time from the host event to the framebuffer changing. nNow is on the
+	// clock the platform stamps events with
+	void TrackInputLatency(int64_t nNow)
+	{
+		if (emu.key_event_time < 0)
+			return;
+
+		// Event times are the low 32 bits, so compare modulo 2^32
+		int64_t nLatency = int64_t(uint32_t(uint32_t(nNow) - uint32_t(emu.key_event_time)));
+
+		if (emu.key_responded)
+		{
+			nInputLatencyCount++;
+			nInputLatencyTotalUs += nLatency;
+			nInputLatencyMaxUs = std::max(nInputLatencyMaxUs, nLatency);
+		}
+		else if (nLatency < 500000)
+			return; // keep waiting, a key the ROM ignores gives up after this
+
+		emu.key_event_time = -1;
+		emu.key_responded = false;
+	}
+
+	// Copies the display into the triple buffer, only repacking the rows
+	// the core touched since the last publish
+	void PublishFrame()
+	{
+		if (emu.is_dirty())
+		{
+			PackRows(nDisplay, emu.dirty_rows);
+			emu.clear_dirty();
+		}
+
+		Frame& frame = frames.write_buffer();
+
+		memcpy(frame.bits, nDisplay, sizeof(nDisplay));
+		frame.fSpeed = fAchievedSpeed;
+
+		// Turbo is already ahead of the player, no point guessing further
+		if (nRunAhead > 0 && !bTurbo)
+			RunAhead(frame);
+
+		frames.publish();
+	}
+
+	// Runs nRunAhead frames past the present with the keys as they are
+	// now, shows the result in frame and rewinds. A ROM that takes a few
+	// frames to react to a key appears to react that much sooner
+	void RunAhead(Frame& frame)
+	{
+		auto tStart = std::chrono::steady_clock::now();
+
+		emu.save_state(stateRunAhead);
+		emu.speculating = true;
+
+		auto tSpeculate = std::chrono::steady_clock::now();
+
+		for (int32_t f = 0; f < nRunAhead; f++)
+			emu.run_frame();
+
+		auto tRewind = std::chrono::steady_clock::now();
+
+		// Rows dirtied by the real frames were packed already, so what's
+		// dirty now is exactly what the speculation changed
+		PackRows(frame.bits, emu.dirty_rows);
+
+		emu.speculating = false;
+		emu.load_state(stateRunAhead);
+
+		auto tEnd = std::chrono::steady_clock::now();
+
+		nRunAheadCalls++;
+		nRunAheadFrames += nRunAhead;
+		nRunAheadNs += std::chrono::duration_cast<std::chrono::nanoseconds>(tRewind - tSpeculate).count();
+		nRunAheadStateNs += std::chrono::duration_cast<std::chrono::nanoseconds>((tSpeculate - tStart) + (tEnd - tRewind)).count();
+	}
+
+	// Copies the given rows of the core's display into bits, which has
+	// the same layout a byte at a time
+	void PackRows(uint8_t bits[32][8], uint32_t nRows)
+	{
+		for (int32_t row = 0; row < emu.display_height; row++)
+		{
+			if (!(nRows & (1u << row)))
+				continue;
+
+			for (int32_t b = 0; b < 8; b++)
+				bits[row][b] = uint8_t(emu.display[row] >> (56 - b * 8));
+		}
+	}
+
+	// Spreads the 32 bits of v to the odd bits of the result
+	static uint64_t SpreadBits(uint32_t v)
+	{
+		uint64_t x = v;
+
+		x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+		x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+		x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+		x = (x | (x << 2)) & 0x3333333333333333ull;
+		x = (x | (x << 1)) & 0x5555555555555555ull;
+
+		return x << 1;
+	}
+
+	// Scale2x (EPX) from src into dst at twice the size. A pixel's four
+	// outputs each take the value of the neighbours either side of that
+	// corner when those agree and the other two don't. With one bit per
+	// pixel every comparison is an xor, so each line of 64 pixels is done
+	// in a handful of word-wide operations
+	static void Scale2x(const uint8_t src[32][8], uint8_t dst[64][16])
+	{
+		uint64_t nRows[32];
+
+		for (int32_t row = 0; row < 32; row++)
+		{
+			nRows[row] = 0;
+
+			for (int32_t b = 0; b < 8; b++)
+				nRows[row] |= uint64_t(src[row][b]) << (56 - b * 8);
+		}
+
+		for (int32_t row = 0; row < 32; row++)
+		{
+			// Off the edges a pixel stands in for its missing neighbour
+			uint64_t p = nRows[row];
+			uint64_t a = row > 0 ? nRows[row - 1] : p; // above
+			uint64_t d = row < 31 ? nRows[row + 1] : p; // below
+			uint64_t l = (p >> 1) | (p & (1ull << 63)); // left
+			uint64_t r = (p << 1) | (p & 1); // right
+
+			uint64_t la = ~(l ^ a), ar = ~(a ^ r), rd = ~(r ^ d), dl = ~(d ^ l);
+
+			uint64_t m0 = la & ~dl & ~ar;
+			uint64_t m1 = ar & ~la & ~rd;
+			uint64_t m2 = dl & ~rd & ~la;
+			uint64_t m3 = rd & ~ar & ~dl;
+
+			uint64_t e[4] =
+			{
+				(a & m0) | (p & ~m0), (r & m1) | (p & ~m1),
+				(l & m2) | (p & ~m2), (d & m3) | (p & ~m3)
+			};
+
+			// Interleave the left and right outputs of each line
+			for (int32_t half = 0; half < 2; half++)
+			{
+				uint64_t nHi = SpreadBits(uint32_t(e[half * 2] >> 32)) | (SpreadBits(uint32_t(e[half * 2 + 1] >> 32)) >> 1);
+				uint64_t nLo = SpreadBits(uint32_t(e[half * 2])) | (SpreadBits(uint32_t(e[half * 2 + 1])) >> 1);
+
+				uint8_t* pOut = dst[row * 2 + half];
+
+				for (int32_t b = 0; b < 8; b++)
+				{
+					pOut[b] = uint8_t(nHi >> (56 - b * 8));
+					pOut[b + 8] = uint8_t(nLo >> (56 - b * 8));
+				}
+			}
+		}
+	}
+
+	// Diffs the newest frame against what the console shows and redraws
+	// the rows that changed
+	void PresentFrame()
+	{
+		const Frame& frame = frames.read_buffer();
+
+		uint32_t nRows = 0;
+		uint64_t nCols = 0; // bit 63 is column 0
+
+		for (int32_t row = 0; row < 32; row++)
+		{
+			uint64_t nDiff = 0;
+
+			for (int32_t b = 0; b < 8; b++)
+				nDiff |= uint64_t(frame.bits[row][b] ^ nShown[row][b]) << (56 - b * 8);
+
+			if (nDiff != 0 || bForceRedraw)
+			{
+				nRows |= 1u << row;
+				nCols |= bForceRedraw ? ~0ull : nDiff;
+			}
+		}
+
+		bForceRedraw = false;
+
+		if (nRows != 0)
+		{
+			memcpy(nShown, frame.bits, sizeof(nShown));
+
+			if (filter == ScaleFilter::Scale2x)
+			{
+				// Each output pixel depends on its neighbours too
+				nRows |= (nRows << 1) | (nRows >> 1);
+				nCols |= (nCols << 1) | (nCols >> 1);
+
+				Scale2x(frame.bits, nScaled);
+			}
+
+			DrawDirtyRegions(frame, nRows, nCols);
+		}
+		else
+			nUnchangedFrames++;
+
+		if (bTurbo)
+		{
+			wchar_t sSpeed[32];
+			swprintf_s(sSpeed, 32, L"TURBO x%.1f", frame.fSpeed);
+			DrawString(0, 0, sSpeed, FG_RED | BG_WHITE);
+			MarkDirty(0, 0, (int32_t)wcslen(sSpeed) - 1, 0);
+		}
+	}
+
+	// Redraws each run of changed display rows, limited to the bytes that
+	// hold changed columns, and marks it for the engine to flush
+	void DrawDirtyRegions(const Frame& frame, uint32_t nRows, uint64_t nCols)
+	{
+		const int16_t* pScanlines = bScanlines ? nScanlinePalette : nullptr;
+
+		int32_t nByteFirst = 0;
+		int32_t nByteLast = 7;
+
+		while (!(nCols & (0xFF00000000000000ull >> (nByteFirst * 8)))) nByteFirst++;
+		while (!(nCols & (0xFF00000000000000ull >> (nByteLast * 8)))) nByteLast--;
+
+		int32_t x = nByteFirst * 8;
+		int32_t w = (nByteLast - nByteFirst + 1) * 8;
+
+		for (int32_t row = 0; row < 32;)
+		{
+			if (!(nRows & (1u << row)))
+			{
+				row++;
+				continue;
+			}
+
+			int32_t nRunFirst = row;
+
+			while (row < 32 && (nRows & (1u << row)))
+				row++;
+
+			if (filter == ScaleFilter::Scale2x)
+			{
+				DrawBitmap(
+					x * nScale, nRunFirst * nScale, w * 2, (row - nRunFirst) * 2,
+					&nScaled[nRunFirst * 2][nByteFirst * 2], 16, nBitPalette, 1, nScale / 2, 0x2588, pScanlines
+				);
+			}
+			else
+			{
+				DrawBitmap(
+					x * nScale, nRunFirst * nScale, w, row - nRunFirst,
+					&frame.bits[nRunFirst][nByteFirst], 8, nBitPalette, 1, nScale, 0x2588, pScanlines
 				);
 			}
 
-		return true;
+			MarkDirty(x * nScale, nRunFirst * nScale, (x + w) * nScale - 1, row * nScale - 1);
+		}
 	}
 
 private:
 	chip8 emu;
-	
+	std::string sRomFile;
+
+	// the core's cycles are its clock, cycles_per_frame at 60 Hz
+	chip8_audio audio{ emu.cycles_per_frame * 60 };
+	std::string sWavFile;
+
+	const float FRAME_TIME = 1.0f / 60.0f;
+
+	// Fed with every emulated frame by whichever thread runs the core
+	chip8_capture capture;
+	std::string sCaptureFile;
+	std::string sCaptureError;
+	int32_t nCaptureScale = 4;
+
+	chip8_shm_export shm;
+	std::string sExportName;
+	std::string sExportError;
+	uint64_t nFramesEmulated = 0;
+
+	// Emulator side, only touched by whichever thread runs the core
+	float fAccumulator = 0.0f;
+
+	float fAchievedSpeed = 1.0f;
+	float fSpeedTimer = 0.0f;
+	int32_t nSpeedFrames = 0;
+
+	uint8_t nDisplay[32][8]{};
+
+	int32_t nRunAhead = 0; // frames to speculate past the present, 0 is off
+	chip8::state stateRunAhead;
+
+	int64_t nRunAheadCalls = 0;
+	int64_t nRunAheadFrames = 0;
+	int64_t nRunAheadNs = 0; // running speculative frames
+	int64_t nRunAheadStateNs = 0; // saving and loading around them
+
+	double dVirtualTime = 0.0;
+
+	int64_t nInputLatencyCount = 0;
+	int64_t nInputLatencyTotalUs = 0;
+	int64_t nInputLatencyMaxUs = 0;
+
+	std::thread tEmulator;
+	std::atomic<bool> bEmulatorRunning{ false };
+
+	// Shared, written by the presenter
+	std::atomic<bool> bTurbo{ false };
+	std::atomic<int32_t> nTurboSpeed{ 0 };
+	const int32_t nTurboFrameSkip = 8;
+
+	triple_buffer<Frame> frames;
+
+	// Presenter side
+	int8_t nHostToKeypad[256]; // -1 for keys that aren't mapped
+	uint16_t nKeypad = 0; // what the core was last told is held
+
+	uint8_t nShown[32][8]{}; // what the console currently shows
+
+	int32_t nScale = 10; // console cells per display pixel
+	ScaleFilter filter = ScaleFilter::Nearest;
+	bool bScanlines = false;
+
+	uint8_t nScaled[64][16]{}; // nShown through Scale2x
+
+	int16_t nBitPalette[2];
+	int16_t nScanlinePalette[2];
+
+	bool bForceRedraw = true;
+	int32_t nUnchangedFrames = 0; // presented without touching the console
+
 };
 
-int main()
+// Usage: chip8 [rom] [--headless frames] [--wav file] [--late-latch] [--run-ahead frames]
+//              [--fps rate] [--frame-stats] [--scale n] [--scale2x] [--scanlines]
+//              [--capture file.y4m|file.gif|file.png] [--capture-scale n] [--shm name] [--sixel | --kitty]
+int main(int argc, char* argv[])
 {
-	Example demo;
+	std::string sRom = "roms/invaders.ch8";
+	uint64_t nHeadlessFrames = 0;
+	std::string sWav;
+	bool bLateLatch = false;
+	int32_t nRunAhead = 0;
+	float fFrameRate = 60.0f; // --fps 0 for no limit
+	bool bFrameStats = false;
+	int32_t nScale = 10;
+	ScaleFilter filter = ScaleFilter::Nearest;
+	bool bScanlines = false;
+	std::string sCapture;
+	int32_t nCaptureScale = 4;
+	std::string sExport;
+
+#ifndef _WIN32
+	TerminalOutput output = TerminalOutput::HalfBlock;
+#endif
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc)
+			nHeadlessFrames = std::stoull(argv[++i]);
+		else if (strcmp(argv[i], "--wav") == 0 && i + 1 < argc)
+			sWav = argv[++i];
+		else if (strcmp(argv[i], "--late-latch") == 0)
+			bLateLatch = true;
+		else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc)
+			nRunAhead = std::stoi(argv[++i]);
+		else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+			fFrameRate = std::stof(argv[++i]);
+		else if (strcmp(argv[i], "--frame-stats") == 0)
+			bFrameStats = true;
+		else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+			nScale = std::stoi(argv[++i]);
+		else if (strcmp(argv[i], "--scale2x") == 0)
+			filter = ScaleFilter::Scale2x;
+		else if (strcmp(argv[i], "--scanlines") == 0)
+			bScanlines = true;
+		else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+			sCapture = argv[++i];
+		else if (strcmp(argv[i], "--capture-scale") == 0 && i + 1 < argc)
+			nCaptureScale = std::stoi(argv[++i]);
+		else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc)
+			sExport = argv[++i];
+#ifndef _WIN32
+		else if (strcmp(argv[i], "--sixel") == 0)
+			output = TerminalOutput::Sixel;
+		else if (strcmp(argv[i], "--kitty") == 0)
+			output = TerminalOutput::Kitty;
+#endif
+		else
+			sRom = argv[i];
+	}
+
+	// Collected before the demo (and with it the terminal state) goes away
+	std::ostringstream stats;
+
+	{
+		Example demo(sRom, sWav, bLateLatch, nRunAhead);
 
-	rcode rc = demo.ConstructConsole(640, 320, 2, 2);
+		if (nHeadlessFrames > 0)
+			demo.SetPlatform(new PlatformHeadless(nHeadlessFrames));
+#ifndef _WIN32
+		else if (output != TerminalOutput::HalfBlock)
+			demo.SetPlatform(new PlatformAnsiTerminal(output));
+#endif
+
+		demo.SetFrameRate(fFrameRate);
+		demo.ShowFrameStats(bFrameStats);
+		demo.SetScaling(nScale, filter, bScanlines);
+		demo.SetCapture(sCapture, nCaptureScale);
+		demo.SetFrameExport(sExport);
+
+		// Smaller scales get bigger fonts, so the window stays about the size
+		// of the default 640x320 at 2x2
+		vi2d size = demo.DisplaySize();
+		int32_t nFont = std::max(2, 20 / std::max(nScale, 1));
+
+		rcode rc = demo.ConstructConsole(size.x, size.y, nFont, nFont);
+
+		if (!rc.ok)
+		{
+			std::cerr << rc.info << '\n';
+			return 1;
+		}
 
-	if (rc.ok)
 		demo.Run();
-	else
-		std::cerr << rc.info << '\n';
+		demo.PrintStats(stats);
+	}
+
+	std::cout << stats.str();
 
 	return 0;
 }
@@ -1,5 +1,20 @@
 #include "chip8.h"
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static inline int32_t count_trailing_zeros(uint16_t v)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, v);
+	return (int32_t)index;
+#else
+	return __builtin_ctz(v);
+#endif
+}
+
 chip8::chip8()
 {
 	
@@ -35,10 +50,77 @@ void chip8::reset()
 
 	memset(reg, 0, sizeof(reg));
 	memset(memory, 0, sizeof(memory));
-	memset(key_state, 0, sizeof(key_state));
+
+	sp = 0;
+	rng = 1;
+
+	key_snapshot = 0;
+	key_mask = 0;
+	waiting_for_key = false;
+
+	key_event_time = -1;
+	key_responded = false;
 
 	delay_timer = 0;
 	sound_timer = 0;
+
+	set_tone(false);
+}
+
+void chip8::save_state(state& s) const
+{
+	memcpy(s.memory, memory, sizeof(memory));
+	memcpy(s.reg, reg, sizeof(reg));
+	s.i = i;
+	s.pc = pc;
+	memcpy(s.stack, stack, sizeof(stack));
+	s.sp = sp;
+	s.opcode = opcode;
+
+	s.delay_timer = delay_timer;
+	s.sound_timer = sound_timer;
+
+	memcpy(s.display, display, sizeof(display));
+	s.dirty_rows = dirty_rows;
+	s.dirty_cols = dirty_cols;
+
+	s.key_mask = key_mask;
+	s.waiting_for_key = waiting_for_key;
+	s.wait_reg = wait_reg;
+
+	s.cycles = cycles;
+	s.skipped_cycles = skipped_cycles;
+	s.rng = rng;
+	s.tone_on = tone_on;
+}
+
+// Doesn't report a buzzer edge, a load is a jump in time rather than
+// something the ROM did
+void chip8::load_state(const state& s)
+{
+	memcpy(memory, s.memory, sizeof(memory));
+	memcpy(reg, s.reg, sizeof(reg));
+	i = s.i;
+	pc = s.pc;
+	memcpy(stack, s.stack, sizeof(stack));
+	sp = s.sp;
+	opcode = s.opcode;
+
+	delay_timer = s.delay_timer;
+	sound_timer = s.sound_timer;
+
+	memcpy(display, s.display, sizeof(display));
+	dirty_rows = s.dirty_rows;
+	dirty_cols = s.dirty_cols;
+
+	key_mask = s.key_mask;
+	waiting_for_key = s.waiting_for_key;
+	wait_reg = s.wait_reg;
+
+	cycles = s.cycles;
+	skipped_cycles = s.skipped_cycles;
+	rng = s.rng;
+	tone_on = s.tone_on;
 }
 
 void chip8::next_opcode()
@@ -58,32 +140,226 @@ void chip8::decrease_timers()
 	if (sound_timer > 0)
 	{
 		sound_timer--;
-		play_sound();
+
+		if (sound_timer == 0)
+			set_tone(false);
 	}
 }
 
-int32_t chip8::get_key_pressed()
+void chip8::execute()
+{
+	switch (opcode & 0xF000)
+	{
+	case 0x0000: decode_opcode_0(); break;
+	case 0x1000: op_1NNN();			break;
+	case 0x2000: op_2NNN();			break;
+	case 0x3000: op_3XNN();			break;
+	case 0x4000: op_4XNN();			break;
+	case 0x5000: op_5XY0();			break;
+	case 0x6000: op_6XNN();			break;
+	case 0x7000: op_7XNN();			break;
+	case 0x8000: decode_opcode_8(); break;
+	case 0x9000: op_9XY0();			break;
+	case 0xA000: op_ANNN();			break;
+	case 0xB000: op_BNNN();			break;
+	case 0xC000: op_CXNN();			break;
+	case 0xD000: op_DXYN();			break;
+	case 0xE000: decode_opcode_e(); break;
+	case 0xF000: decode_opcode_f(); break;
+	}
+}
+
+void chip8::cycle()
+{
+	next_opcode();
+	execute();
+
+	cycles++;
+}
+
+void chip8::run_frame()
+{
+	decrease_timers();
+
+	// A parked FX0A has nothing else to latch for it
+	if (!late_latch || waiting_for_key)
+		latch_keys();
+
+	for (int32_t c = 0; c < cycles_per_frame; c++)
+	{
+		// Timers only change between frames, so once an idle idiom is
+		// detected the rest of this frame can't make any progress
+		if (waiting_for_key || (idle_skip && is_idle()))
+		{
+			skipped_cycles += cycles_per_frame - c;
+			cycles += cycles_per_frame - c;
+			return;
+		}
+
+		cycle();
+	}
+}
+
+// Ends up where as many run_frame() calls would, but skips idle stretches
+// whole. Skipping doesn't latch keys, so new ones get a real frame first
+void chip8::run_frames(int32_t frames)
 {
-	for (int k = 0; k < 16; k++)
+	uint64_t snapshot = key_snapshot.load(std::memory_order_acquire);
+	int32_t f = 0;
+
+	if (frames > 0 && uint16_t(snapshot | (snapshot >> 16)) != key_mask)
+	{
+		run_frame();
+		f++;
+	}
+
+	while (f < frames)
+	{
+		int32_t skipped = skip_frames(frames - f);
+
+		if (skipped > 0)
+			f += skipped;
+		else
+		{
+			run_frame();
+			f++;
+		}
+	}
+}
+
+bool chip8::is_idle()
+{
+	if (waiting_for_key)
+		return true;
+
+	if ((size_t)pc + 6 > sizeof(memory))
+		return false;
+
+	uint16_t op = (memory[pc] << 8) | memory[pc + 1];
+
+	// 1NNN jumping to itself
+	if (op == (0x1000 | pc))
+		return true;
+
+	int32_t nn;
+	bool until_equal;
+
+	if (decode_delay_loop(nn, until_equal))
+		return until_equal ? delay_timer != nn : delay_timer == nn;
+
+	return false;
+}
+
+int32_t chip8::frames_until_wake()
+{
+	if (!is_idle())
+		return 0;
+
+	int32_t nn;
+	bool until_equal;
+
+	// Only the delay loop wakes up on its own, the rest need input
+	if (waiting_for_key || !decode_delay_loop(nn, until_equal) || delay_timer == 0)
+		return -1;
+
+	if (until_equal)
+		return delay_timer > nn ? delay_timer - nn : -1;
+
+	return 1;
+}
+
+int32_t chip8::skip_frames(int32_t frames)
+{
+	if (waiting_for_key)
+		latch_keys();
+
+	// Only a parked FX0A is skipped with idle_skip off, as in run_frame()
+	if (!idle_skip && !waiting_for_key)
+		return 0;
+
+	int32_t wake = frames_until_wake();
+
+	// The wake-th frame's timer tick ends the wait, and the rest of that
+	// frame runs the ROM, so only the ones before it can be skipped
+	if (wake > 0 && frames > wake - 1)
+		frames = wake - 1;
+
+	if (wake == 0 || frames <= 0)
+		return 0;
+
+	uint64_t start = cycles;
+
+	// Step the clock with the timers so a buzzer edge gets the right time
+	for (int32_t f = 0; f < frames && (delay_timer > 0 || sound_timer > 0); f++)
+	{
+		cycles = start + (uint64_t)f * cycles_per_frame;
+		decrease_timers();
+	}
+
+	skipped_cycles += (uint64_t)frames * cycles_per_frame;
+	cycles = start + (uint64_t)frames * cycles_per_frame;
+
+	return frames;
+}
+
+bool chip8::decode_delay_loop(int32_t& nn, bool& until_equal)
+{
+	// FX07, 3XNN (or 4XNN), 1NNN back to the FX07
+	uint16_t op1 = (memory[pc] << 8) | memory[pc + 1];
+	uint16_t op2 = (memory[pc + 2] << 8) | memory[pc + 3];
+	uint16_t op3 = (memory[pc + 4] << 8) | memory[pc + 5];
+
+	if ((op1 & 0xF0FF) != 0xF007 || op3 != (0x1000 | pc))
+		return false;
+
+	if ((op2 & 0x0F00) != (op1 & 0x0F00))
+		return false;
+
+	nn = op2 & 0x00FF;
+
+	switch (op2 & 0xF000)
 	{
-		if (key_state[k] > 0)
-			return k;
+	case 0x3000: until_equal = true; return true;
+	case 0x4000: until_equal = false; return true;
 	}
 
-	return -1;
+	return false;
+}
+
+void chip8::mark_written(uint32_t from, uint32_t count)
+{
+	uint32_t last = (from + count - 1) >> 6;
+
+	for (uint32_t block = from >> 6; block <= last && block < 64; block++)
+		dirty_memory |= 1ull << block;
+}
+
+int32_t chip8::get_key_pressed()
+{
+	uint16_t mask = key_mask;
+
+	if (mask == 0)
+		return -1;
+
+	return count_trailing_zeros(mask);
 }
 
 void chip8::op_00E0()
 {
-	for (int x = 0; x < screen_width; x++)
-		for (int y = 0; y < screen_height; y++)
-			screen[y * screen_width + x] = 255;
+	memset(display, 0, sizeof(display));
+
+	dirty_rows = 0xFFFFFFFF;
+	dirty_cols = 0xFFFFFFFFFFFFFFFF;
+
+	if (key_event_time >= 0)
+		key_responded = true;
 }
 
 void chip8::op_00EE()
 {
-	pc = stack.back();
-	stack.pop_back();
+	// 16 levels, deeper calls wrap rather than run off the array
+	sp = (sp - 1) & 0xF;
+	pc = stack[sp];
 }
 
 void chip8::op_1NNN()
@@ -93,7 +369,8 @@ void chip8::op_1NNN()
 
 void chip8::op_2NNN()
 {
-	stack.push_back(pc);
+	stack[sp] = pc;
+	sp = (sp + 1) & 0xF;
 	pc = opcode & 0x0FFF;
 }
 
@@ -319,13 +596,16 @@ void chip8::op_CXNN()
 	x = opcode & 0x0F00;
 	x = x >> 8;
 
-	reg[x] = rand() & nn;
+	// xorshift32
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+
+	reg[x] = (rng >> 8) & nn;
 }
 
 void chip8::op_DXYN()
 {
-	const int32_t scale = 10;
-
 	int32_t x, y;
 
 	x = opcode & 0x0F00;
@@ -336,45 +616,37 @@ void chip8::op_DXYN()
 
 	int32_t coord_x, coord_y, height;
 
-	coord_x = reg[x] * scale;
-	coord_y = reg[y] * scale;
+	coord_x = reg[x];
+	coord_y = reg[y];
 
 	height = opcode & 0x000F;
 
 	reg[0xF] = 0;
 
-	for (int yline = 0; yline < height; yline++)
+	// Sprites are clipped at the right and bottom edges, not wrapped
+	if (coord_x >= display_width)
+		return;
+
+	for (int yline = 0; yline < height && coord_y + yline < display_height; yline++)
 	{
-		uint8_t data = memory[i + yline];
-		int32_t xpixelinv = 7;
+		uint64_t row = uint64_t(memory[i + yline]) << 56 >> coord_x;
 
-		for (int xpixel = 0; xpixel < 8; xpixel++, xpixelinv--)
-		{
-			int32_t mask = 1 << xpixelinv;
-			if (data & mask)
-			{
-				int32_t spr_x = xpixel * scale + coord_x;
-				int32_t spr_y = yline * scale + coord_y;
-
-				int32_t colour = 0;
-
-				if (screen[spr_y * screen_width + spr_x] == 0)
-				{
-					colour = 255;
-					reg[15] = 1;
-				}
-
-				for (int c = 0; c < scale; c++)
-				{
-					for (int r = 0; r < scale; r++)
-					{
-						if (spr_y + r < screen_height && spr_x + c < screen_width && spr_x + c >= 0 && spr_y + r >= 0)
-							screen[(spr_y + r) * screen_width + (spr_x + c)] = (uint8_t)colour;
-					}
-				}
-
-			}
-		}
+		if (row == 0)
+			continue;
+
+		uint64_t& line = display[coord_y + yline];
+
+		if (line & row)
+			reg[0xF] = 1;
+
+		line ^= row;
+
+		// Every set bit flips a cell, so those are exactly what changed
+		dirty_rows |= 1u << (coord_y + yline);
+		dirty_cols |= row;
+
+		if (key_event_time >= 0)
+			key_responded = true;
 	}
 }
 
@@ -387,7 +659,10 @@ void chip8::op_EX9E()
 
 	key = reg[x];
 
-	if (key_state[key] == 1)
+	if (late_latch)
+		latch_keys();
+
+	if (key_mask & (1 << (key & 0xF)))
 		pc += 2;
 }
 
@@ -400,7 +675,10 @@ void chip8::op_EXA1()
 
 	key = reg[x];
 
-	if (key_state[key] == 0)
+	if (late_latch)
+		latch_keys();
+
+	if (!(key_mask & (1 << (key & 0xF))))
 		pc += 2;
 }
 
@@ -421,10 +699,17 @@ void chip8::op_FX0A()
 	x = opcode & 0x0F00;
 	x = x >> 8;
 
+	if (late_latch)
+		latch_keys();
+
 	int32_t keypressed = get_key_pressed();
 
 	if (keypressed == -1)
-		pc -= 2;
+	{
+		// latch_keys() finishes the instruction
+		waiting_for_key = true;
+		wait_reg = x;
+	}
 	else
 		reg[x] = keypressed;
 }
@@ -447,6 +732,8 @@ void chip8::op_FX18()
 	x = x >> 8;
 
 	sound_timer = reg[x];
+
+	set_tone(sound_timer > 0);
 }
 
 void chip8::op_FX1E()
@@ -489,6 +776,8 @@ void chip8::op_FX33()
 	memory[i] = hundreds;
 	memory[i + 1] = tens;
 	memory[i + 2] = units;
+
+	mark_written(i, 3);
 }
 
 void chip8::op_FX55()
@@ -501,6 +790,8 @@ void chip8::op_FX55()
 	for (int k = 0; k <= x; k++)
 		memory[i + k] = reg[k];
 
+	mark_written(i, x + 1);
+
 	i += x + 1;
 }
 
@@ -567,17 +858,130 @@ void chip8::decode_opcode_f()
 	}
 }
 
+bool chip8::is_dirty() const
+{
+	return dirty_rows != 0;
+}
+
+void chip8::clear_dirty()
+{
+	dirty_rows = 0;
+	dirty_cols = 0;
+}
+
+void chip8::set_keys(uint16_t mask, int64_t time_us)
+{
+	uint64_t snapshot = key_snapshot.load(std::memory_order_relaxed);
+	uint64_t next;
+
+	do
+	{
+		uint16_t held = snapshot & 0xFFFF;
+		uint16_t taps = (snapshot >> 16) & 0xFFFF;
+
+		taps |= mask & ~held;
+		next = (uint64_t(uint32_t(time_us)) << 32) | (uint64_t(taps) << 16) | mask;
+	}
+	while (!key_snapshot.compare_exchange_weak(snapshot, next, std::memory_order_release, std::memory_order_relaxed));
+
+	// The core never takes the mutex to read keys, it's only here so the
+	// notify can't slip in between wait_for_key() checking and sleeping
+	{
+		std::lock_guard<std::mutex> lock(key_mutex);
+	}
+
+	key_cond.notify_all();
+}
+
 void chip8::press_key(int key)
 {
-	key_state[key] = 1;
+	set_keys(uint16_t(key_snapshot.load() | (1 << key)));
 }
 
 void chip8::release_key(int key)
 {
-	key_state[key] = 0;
+	set_keys(uint16_t(key_snapshot.load() & ~(1 << key)));
+}
+
+bool chip8::wait_for_key(int32_t timeout_ms)
+{
+	std::unique_lock<std::mutex> lock(key_mutex);
+
+	// Only a key the core hasn't latched yet can finish the FX0A
+	auto ready = [this]
+	{
+		uint64_t snapshot = key_snapshot.load(std::memory_order_acquire);
+		uint16_t seen = uint16_t(snapshot | (snapshot >> 16));
+
+		return wait_interrupted || !waiting_for_key || (seen & ~key_mask) != 0;
+	};
+
+	bool woken = true;
+
+	if (timeout_ms < 0)
+		key_cond.wait(lock, ready);
+	else
+		woken = key_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+
+	wait_interrupted = false;
+	return woken;
 }
 
-void chip8::set_audio(bool (*sound_handler)())
+void chip8::interrupt_wait()
 {
-	play_sound = sound_handler;
+	{
+		std::lock_guard<std::mutex> lock(key_mutex);
+		wait_interrupted = true;
+	}
+
+	key_cond.notify_all();
+}
+
+void chip8::latch_keys()
+{
+	uint64_t snapshot = key_snapshot.load(std::memory_order_acquire);
+
+	// Take the taps, anything the host publishes meanwhile keeps its own
+	while (!speculating && (snapshot & 0xFFFF0000) && !key_snapshot.compare_exchange_weak(snapshot, snapshot & ~0xFFFF0000ull, std::memory_order_acquire))
+		;
+
+	// A tap counts as held for the one latch that sees it
+	uint16_t seen = uint16_t(snapshot | (snapshot >> 16));
+
+	if (seen == key_mask)
+		return;
+
+	uint16_t pressed = seen & ~key_mask;
+	key_mask = seen;
+
+	// Releases rarely draw anything, so only presses are timed
+	if (key_event_time < 0 && pressed && (snapshot >> 32) != 0)
+	{
+		key_event_time = int64_t(snapshot >> 32);
+		key_responded = false;
+	}
+
+	// The lowest newly pressed key completes an FX0A
+	if (waiting_for_key && pressed)
+	{
+		reg[wait_reg] = count_trailing_zeros(pressed);
+		waiting_for_key = false;
+	}
+}
+
+void chip8::set_audio(void (*handler)(void* user, bool on, uint64_t cycle), void* user)
+{
+	tone_handler = handler;
+	tone_user = user;
+}
+
+void chip8::set_tone(bool on)
+{
+	if (on == tone_on)
+		return;
+
+	tone_on = on;
+
+	if (tone_handler && !speculating)
+		tone_handler(tone_user, on, cycles);
 }
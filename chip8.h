@@ -3,9 +3,15 @@
 #include <vector>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
+#ifdef _MSC_VER
 #pragma warning(disable : 4996)
+#endif
 
 class chip8
 {
@@ -18,35 +24,133 @@ public: // system
 	uint8_t reg[16];
 	uint16_t i;
 	uint16_t pc;
-	std::vector<uint16_t> stack;
+	uint16_t stack[16];
+	uint8_t sp = 0;
 
 	uint16_t opcode;
 
 	uint8_t delay_timer;
 	uint8_t sound_timer;
 
-	const int32_t screen_width = 640;
-	const int32_t screen_height = 320;
-
 	// graphics
-	uint8_t screen[640 * 320];
+	const int32_t display_width = 64;
+	const int32_t display_height = 32;
+
+	// The display at its native resolution, one row per word with bit 63
+	// as column 0, so a sprite row is drawn with one shift and one xor.
+	// Scaling it up is the presenter's business
+	uint64_t display[32];
+
+	// Display cells touched since the last clear_dirty(): bit n of
+	// dirty_rows is row n, dirty_cols is laid out like a display row
+	uint32_t dirty_rows = 0;
+	uint64_t dirty_cols = 0;
+
+	// 64-byte blocks of memory the ROM has written (FX33, FX55) since the
+	// host last cleared it, bit n for bytes 64n to 64n + 63
+	uint64_t dirty_memory = 0;
 
 	// controls
-	uint8_t key_state[16];
+	// The host publishes the keypad here from any thread without locking:
+	// bits 0-15 are held keys, 16-31 keys pressed since the core last
+	// latched (so a tap shorter than a frame isn't lost) and 32-63 the low
+	// 32 bits of the event's host time in microseconds (0 if unknown)
+	std::atomic<uint64_t> key_snapshot{ 0 };
+
+	// The keypad as the core sees it, latched from key_snapshot at the
+	// start of each frame, or with late_latch by EX9E, EXA1 and FX0A as
+	// they execute so they see keys that arrived mid-frame
+	uint16_t key_mask = 0;
+	bool late_latch = false;
+
+	// FX0A parks the core here instead of re-executing itself
+	std::atomic<bool> waiting_for_key{ false };
+	int32_t wait_reg = 0;
+
+	// Host time (low 32 bits, us) of the oldest latched key press the
+	// display hasn't reacted to yet, -1 if none. key_responded is set by
+	// the first draw after it, the host reads and resets both
+	int64_t key_event_time = -1;
+	bool key_responded = false;
+
+	// timing
+	int32_t cycles_per_frame = 10; // instructions per 60 Hz timer tick
+	uint64_t cycles = 0; // executed + skipped
+	uint64_t skipped_cycles = 0; // spent in detected idle loops
+	bool idle_skip = true;
+
+	uint32_t rng = 1; // CXNN's generator, part of the state so it rewinds
+
+	// Set while running frames that will be thrown away (run-ahead): the
+	// buzzer stays silent and key taps are left for the real frames
+	bool speculating = false;
+
+	// Everything the ROM can observe, trivially copyable so a save or a
+	// load is a handful of memcpys
+	struct state
+	{
+		uint8_t memory[0xFFF];
+		uint8_t reg[16];
+		uint16_t i;
+		uint16_t pc;
+		uint16_t stack[16];
+		uint8_t sp;
+		uint16_t opcode;
+
+		uint8_t delay_timer;
+		uint8_t sound_timer;
+
+		uint64_t display[32];
+		uint32_t dirty_rows;
+		uint64_t dirty_cols;
+
+		uint16_t key_mask;
+		bool waiting_for_key;
+		int32_t wait_reg;
+
+		uint64_t cycles;
+		uint64_t skipped_cycles;
+		uint32_t rng;
+		bool tone_on;
+	};
 
 public:
 	void reset();
 	bool load_rom(const std::string& name);
 
+	void save_state(state& s) const;
+	void load_state(const state& s);
+
 	void next_opcode();
 	void decrease_timers();
 
+	void execute();
+	void cycle();
+	void run_frame();
+	void run_frames(int32_t frames);
+
+	bool is_idle();
+	int32_t frames_until_wake();
+	int32_t skip_frames(int32_t frames);
+
 	int32_t get_key_pressed();
+	void set_keys(uint16_t mask, int64_t time_us = 0); // bit k set while key k is held
 	void press_key(int key);
 	void release_key(int key);
+	bool wait_for_key(int32_t timeout_ms); // < 0 waits for as long as it takes
+	void interrupt_wait(); // wakes wait_for_key() without a key, e.g. to shut down
+	void latch_keys(); // core thread only
+
+	bool is_dirty() const;
+	void clear_dirty();
+
+	// audio: called on every buzzer on/off edge with the emulated time
+	// of the edge in cycles (cycles_per_frame * 60 per second)
+	void (*tone_handler)(void* user, bool on, uint64_t cycle) = nullptr;
+	void* tone_user = nullptr;
+	bool tone_on = false;
 
-	bool (*play_sound)();
-	void set_audio(bool (*sound_handler)());
+	void set_audio(void (*handler)(void* user, bool on, uint64_t cycle), void* user);
 
 public:
 	// opcodes
@@ -91,5 +195,14 @@ public:
 	void decode_opcode_e();
 	void decode_opcode_f();
 
+private:
+	bool decode_delay_loop(int32_t& nn, bool& until_equal);
+	void mark_written(uint32_t from, uint32_t count);
+	void set_tone(bool on);
+
+	std::mutex key_mutex;
+	std::condition_variable key_cond;
+	bool wait_interrupted = false; // under key_mutex
+
 };
 
@@ -0,0 +1,479 @@
+#include "chip8_audio.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+
+#ifdef _MSC_VER
+#pragma comment(lib, "winmm.lib")
+#endif
+#endif
+
+static int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Smooths the step of a naive square wave over one sample either side of
+// the discontinuity at t = 0, dt is the phase step per sample
+static float poly_blep(double t, double dt)
+{
+	if (t < dt)
+	{
+		t /= dt;
+		return float(t + t - t * t - 1.0);
+	}
+
+	if (t > 1.0 - dt)
+	{
+		t = (t - 1.0) / dt;
+		return float(t * t + t + t + 1.0);
+	}
+
+	return 0.0f;
+}
+
+static void put_u16(uint8_t* p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+	put_u16(p, v & 0xFFFF);
+	put_u16(p + 2, v >> 16);
+}
+
+wav_audio_sink::wav_audio_sink(const std::string& path) : path(path)
+{
+
+}
+
+wav_audio_sink::~wav_audio_sink()
+{
+	if (file)
+	{
+		fseek(file, 0, SEEK_SET);
+		write_header();
+		fclose(file);
+	}
+}
+
+bool wav_audio_sink::open(int32_t sample_rate)
+{
+	this->sample_rate = sample_rate;
+
+	file = fopen(path.c_str(), "wb");
+
+	if (!file)
+		return false;
+
+	// placeholder sizes until the destructor knows them
+	write_header();
+	return true;
+}
+
+void wav_audio_sink::write(const int16_t* samples, int32_t count)
+{
+	if (!file)
+		return;
+
+	fwrite(samples, sizeof(int16_t), count, file);
+	data_bytes += count * sizeof(int16_t);
+}
+
+void wav_audio_sink::write_header()
+{
+	uint8_t header[44];
+
+	memcpy(header, "RIFF", 4);
+	put_u32(header + 4, 36 + data_bytes);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	put_u32(header + 16, 16);
+	put_u16(header + 20, 1); // PCM
+	put_u16(header + 22, 1); // mono
+	put_u32(header + 24, sample_rate);
+	put_u32(header + 28, sample_rate * sizeof(int16_t));
+	put_u16(header + 32, sizeof(int16_t));
+	put_u16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	put_u32(header + 40, data_bytes);
+
+	fwrite(header, 1, sizeof(header), file);
+}
+
+#ifdef _WIN32
+struct waveout_audio_sink::device
+{
+	static const int32_t buffer_count = 4;
+
+	HWAVEOUT handle = nullptr;
+	HANDLE event = nullptr;
+
+	WAVEHDR headers[buffer_count]{};
+	std::vector<int16_t> buffers[buffer_count];
+	int32_t next = 0;
+};
+
+waveout_audio_sink::waveout_audio_sink() : dev(new device)
+{
+
+}
+
+waveout_audio_sink::~waveout_audio_sink()
+{
+	if (dev->handle)
+	{
+		waveOutReset(dev->handle);
+
+		for (WAVEHDR& hdr : dev->headers)
+		{
+			if (hdr.dwFlags & WHDR_PREPARED)
+				waveOutUnprepareHeader(dev->handle, &hdr, sizeof(WAVEHDR));
+		}
+
+		waveOutClose(dev->handle);
+	}
+
+	if (dev->event)
+		CloseHandle(dev->event);
+}
+
+bool waveout_audio_sink::open(int32_t sample_rate)
+{
+	dev->event = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+
+	WAVEFORMATEX format{};
+	format.wFormatTag = WAVE_FORMAT_PCM;
+	format.nChannels = 1;
+	format.nSamplesPerSec = sample_rate;
+	format.nAvgBytesPerSec = sample_rate * sizeof(int16_t);
+	format.nBlockAlign = sizeof(int16_t);
+	format.wBitsPerSample = 16;
+
+	// The event is signalled every time the device finishes a buffer
+	if (waveOutOpen(&dev->handle, WAVE_MAPPER, &format, (DWORD_PTR)dev->event, 0, CALLBACK_EVENT) != MMSYSERR_NOERROR)
+	{
+		dev->handle = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+void waveout_audio_sink::write(const int16_t* samples, int32_t count)
+{
+	if (!dev->handle)
+		return;
+
+	WAVEHDR& hdr = dev->headers[dev->next];
+
+	// Blocks at the device rate once all buffers are queued
+	while (hdr.dwFlags & WHDR_INQUEUE)
+		WaitForSingleObject(dev->event, 100);
+
+	if (hdr.dwFlags & WHDR_PREPARED)
+		waveOutUnprepareHeader(dev->handle, &hdr, sizeof(WAVEHDR));
+
+	std::vector<int16_t>& buffer = dev->buffers[dev->next];
+	buffer.assign(samples, samples + count);
+
+	hdr = WAVEHDR{};
+	hdr.lpData = (LPSTR)buffer.data();
+	hdr.dwBufferLength = count * sizeof(int16_t);
+
+	waveOutPrepareHeader(dev->handle, &hdr, sizeof(WAVEHDR));
+	waveOutWrite(dev->handle, &hdr, sizeof(WAVEHDR));
+
+	dev->next = (dev->next + 1) % device::buffer_count;
+}
+
+int32_t waveout_audio_sink::queued() const
+{
+	int32_t count = 0;
+
+	for (const WAVEHDR& hdr : dev->headers)
+	{
+		if (hdr.dwFlags & WHDR_INQUEUE)
+			count += hdr.dwBufferLength / sizeof(int16_t);
+	}
+
+	return count;
+}
+#endif
+
+chip8_audio::chip8_audio(int32_t cycle_rate, int32_t sample_rate, float frequency)
+	: cycle_rate(cycle_rate), sample_rate(sample_rate), ring(8192)
+{
+	phase_step = (double)frequency / sample_rate;
+
+	period = 256;
+	prefill = sample_rate / 30; // two 60 Hz frames
+	high_water = sample_rate / 15;
+
+	scratch.resize(1024);
+	buffer.resize(1024);
+}
+
+chip8_audio::~chip8_audio()
+{
+	stop();
+}
+
+bool chip8_audio::start(audio_sink* new_sink, bool live)
+{
+	stop();
+
+	sink.reset(new_sink);
+
+	if (!sink->open(sample_rate))
+	{
+		sink.reset();
+		return false;
+	}
+
+	this->live = live;
+
+	if (live)
+	{
+		running = true;
+		thread = std::thread(&chip8_audio::audio_thread, this);
+	}
+
+	return true;
+}
+
+void chip8_audio::stop()
+{
+	if (thread.joinable())
+	{
+		running = false;
+		thread.join();
+	}
+
+	if (sink && !live)
+		drain();
+
+	sink.reset();
+}
+
+void chip8_audio::tone(bool on, uint64_t cycle)
+{
+	edges.push_back({ on, cycle * sample_rate / cycle_rate });
+
+	if (on && pending_probe_time < 0)
+		pending_probe_time = now_ns();
+}
+
+void chip8_audio::render(uint64_t cycle)
+{
+	uint64_t target = cycle * sample_rate / cycle_rate;
+
+	if (!sink)
+	{
+		edges.clear();
+		return;
+	}
+
+	if (target <= rendered)
+		return;
+
+	uint64_t count = target - rendered;
+
+	// The sink plays at 1x, so anything that would queue past high_water
+	// (turbo, or the host clock drifting from the emulated one) is skipped
+	// from the front to keep the latency bounded
+	if (live)
+	{
+		size_t queued = ring.size();
+		uint64_t room = queued < (size_t)high_water ? high_water - queued : 0;
+
+		if (count > room)
+		{
+			skip(count - room);
+			dropped_samples += count - room;
+			count = room;
+		}
+	}
+
+	while (count > 0)
+	{
+		int32_t n = (int32_t)std::min<uint64_t>(count, scratch.size());
+
+		synthesize(scratch.data(), n);
+		ring.write(scratch.data(), n);
+
+		written += n;
+		count -= n;
+
+		if (!live)
+			drain();
+	}
+
+	// Every edge at or before the rendered time has been applied
+	edges.erase(std::remove_if(edges.begin(), edges.end(), [this](const edge& e) { return e.sample < rendered; }), edges.end());
+}
+
+void chip8_audio::tone_handler(void* user, bool on, uint64_t cycle)
+{
+	static_cast<chip8_audio*>(user)->tone(on, cycle);
+}
+
+float chip8_audio::average_latency_ms() const
+{
+	uint64_t count = latency_count;
+	return count ? (float)latency_total_us / count / 1000.0f : 0.0f;
+}
+
+float chip8_audio::max_latency_ms() const
+{
+	return (float)latency_max_us / 1000.0f;
+}
+
+void chip8_audio::audio_thread()
+{
+	auto step = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>((double)period / sample_rate));
+
+	auto next = std::chrono::steady_clock::now();
+
+	while (running)
+	{
+		pull(buffer.data(), period);
+		sink->write(buffer.data(), period);
+
+		if (!sink->paced())
+		{
+			next += step;
+			std::this_thread::sleep_until(next);
+		}
+	}
+}
+
+void chip8_audio::pull(int16_t* out, int32_t count)
+{
+	samples_played += count;
+
+	// Wait for a cushion before (re)starting so one late frame from the
+	// core doesn't turn into a string of underruns
+	if (!primed)
+	{
+		if (ring.size() < (size_t)prefill)
+		{
+			memset(out, 0, count * sizeof(int16_t));
+			return;
+		}
+
+		primed = true;
+	}
+
+	size_t n = ring.read(out, count);
+
+	if (n < (size_t)count)
+	{
+		memset(out + n, 0, (count - n) * sizeof(int16_t));
+		underruns++;
+		primed = false;
+	}
+
+	uint64_t position = probe_position.load(std::memory_order_acquire);
+
+	if (position != UINT64_MAX && ring.read_position() > position)
+	{
+		int64_t us = (now_ns() - probe_time.load(std::memory_order_relaxed)) / 1000;
+		us += (int64_t)sink->queued() * 1000000 / sample_rate;
+
+		latency_count++;
+		latency_total_us += us;
+
+		if ((uint64_t)us > latency_max_us)
+			latency_max_us = us;
+
+		probe_position.store(UINT64_MAX, std::memory_order_release);
+	}
+}
+
+void chip8_audio::drain()
+{
+	size_t n;
+
+	while ((n = ring.read(buffer.data(), buffer.size())) > 0)
+	{
+		sink->write(buffer.data(), (int32_t)n);
+		samples_played += n;
+	}
+}
+
+void chip8_audio::synthesize(int16_t* out, int32_t count)
+{
+	size_t next_edge = 0;
+
+	while (next_edge < edges.size() && edges[next_edge].sample < rendered)
+		next_edge++;
+
+	for (int32_t k = 0; k < count; k++, rendered++)
+	{
+		while (next_edge < edges.size() && edges[next_edge].sample <= rendered)
+		{
+			on = edges[next_edge++].on;
+
+			if (!on)
+				continue;
+
+			phase = 0.0;
+
+			if (pending_probe_time >= 0 && probe_position == UINT64_MAX)
+			{
+				probe_time.store(pending_probe_time, std::memory_order_relaxed);
+				probe_position.store(written + k, std::memory_order_release);
+			}
+
+			pending_probe_time = -1;
+		}
+
+		gain += ((on ? volume : 0.0f) - gain) * ramp;
+
+		if (!on && gain < 1e-4f)
+		{
+			gain = 0.0f;
+			out[k] = 0;
+			continue;
+		}
+
+		float v = phase < 0.5 ? 1.0f : -1.0f;
+		v += poly_blep(phase, phase_step);
+		v -= poly_blep(std::fmod(phase + 0.5, 1.0), phase_step);
+
+		phase += phase_step;
+
+		if (phase >= 1.0)
+			phase -= 1.0;
+
+		out[k] = int16_t(v * gain * 32767.0f);
+	}
+}
+
+void chip8_audio::skip(uint64_t count)
+{
+	uint64_t end = rendered + count;
+
+	for (const edge& e : edges)
+	{
+		if (e.sample >= rendered && e.sample < end)
+			on = e.on;
+	}
+
+	phase = std::fmod(phase + (double)count * phase_step, 1.0);
+	gain = on ? volume : 0.0f;
+	pending_probe_time = -1;
+
+	rendered = end;
+}
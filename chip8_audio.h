@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+#include "spsc_ring.h"
+
+// Where rendered audio ends up: mono 16-bit PCM, written from the audio
+// thread (or from chip8_audio::render() when not live)
+class audio_sink
+{
+public:
+	virtual ~audio_sink() = default;
+
+	virtual bool open(int32_t sample_rate) = 0;
+	virtual void write(const int16_t* samples, int32_t count) = 0;
+
+	// True if write() blocks at the device's rate, otherwise the audio
+	// thread paces itself off the host clock
+	virtual bool paced() const { return false; }
+
+	// Samples accepted by write() that haven't been heard yet
+	virtual int32_t queued() const { return 0; }
+};
+
+// Discards everything, for machines without (or runs without) a device
+class null_audio_sink : public audio_sink
+{
+public:
+	bool open(int32_t) override { return true; }
+	void write(const int16_t*, int32_t) override {}
+};
+
+// Records to a .wav file, the header is filled in on close
+class wav_audio_sink : public audio_sink
+{
+public:
+	wav_audio_sink(const std::string& path);
+	~wav_audio_sink();
+
+	bool open(int32_t sample_rate) override;
+	void write(const int16_t* samples, int32_t count) override;
+
+private:
+	void write_header();
+
+	std::string path;
+	FILE* file = nullptr;
+
+	int32_t sample_rate = 0;
+	uint32_t data_bytes = 0;
+};
+
+#ifdef _WIN32
+class waveout_audio_sink : public audio_sink
+{
+public:
+	waveout_audio_sink();
+	~waveout_audio_sink();
+
+	bool open(int32_t sample_rate) override;
+	void write(const int16_t* samples, int32_t count) override;
+
+	bool paced() const override { return true; }
+	int32_t queued() const override;
+
+private:
+	struct device;
+	std::unique_ptr<device> dev;
+};
+#endif
+
+// Turns the core's buzzer edges into a band-limited (PolyBLEP) square
+// wave and queues it for a sink. The thread running the core renders,
+// the audio thread (or render() itself when not live) consumes, and the
+// ring between them is the only state they share.
+class chip8_audio
+{
+public:
+	chip8_audio(int32_t cycle_rate, int32_t sample_rate = 44100, float frequency = 440.0f);
+	~chip8_audio();
+
+	// Takes ownership of sink. Live sinks are fed on a thread in real
+	// time, otherwise everything rendered goes straight through
+	bool start(audio_sink* new_sink, bool live);
+	void stop();
+
+	// Producer side, the core's thread
+
+	void tone(bool on, uint64_t cycle);
+	void render(uint64_t cycle); // up to the emulated time cycle
+
+	// For chip8::set_audio(), user is the chip8_audio
+	static void tone_handler(void* user, bool on, uint64_t cycle);
+
+	float average_latency_ms() const;
+	float max_latency_ms() const;
+
+public:
+	std::atomic<uint64_t> samples_played{ 0 };
+	std::atomic<uint64_t> underruns{ 0 }; // sink got silence because the core fell behind
+	std::atomic<uint64_t> dropped_samples{ 0 }; // rendered too far ahead (e.g. turbo) and skipped
+
+private:
+	struct edge
+	{
+		bool on;
+		uint64_t sample;
+	};
+
+	void audio_thread();
+	void pull(int16_t* out, int32_t count);
+	void drain();
+
+	void synthesize(int16_t* out, int32_t count);
+	void skip(uint64_t count);
+
+private:
+	int32_t cycle_rate;
+	int32_t sample_rate;
+	double phase_step;
+
+	const float volume = 0.25f;
+	const float ramp = 1.0f / 32.0f; // gain smoothing per sample, avoids clicks
+
+	int32_t period; // samples per sink write
+	int32_t prefill; // queued before the sink starts (or restarts) playing
+	int32_t high_water; // most that may be queued, bounds the latency
+
+	spsc_ring<int16_t> ring;
+	std::unique_ptr<audio_sink> sink;
+	bool live = false;
+
+	std::thread thread;
+	std::atomic<bool> running{ false };
+
+	// producer
+	std::vector<edge> edges;
+	std::vector<int16_t> scratch;
+	uint64_t rendered = 0; // emulated samples accounted for, including skipped ones
+	uint64_t written = 0; // samples pushed into the ring
+	double phase = 0.0;
+	float gain = 0.0f;
+	bool on = false;
+
+	// consumer
+	std::vector<int16_t> buffer;
+	bool primed = false;
+
+	// latency probe: ring position of a tone-on sample and when the core
+	// emitted the edge, picked up once the consumer plays past it
+	std::atomic<uint64_t> probe_position{ UINT64_MAX };
+	std::atomic<int64_t> probe_time{ 0 };
+	int64_t pending_probe_time = -1;
+
+	std::atomic<uint64_t> latency_count{ 0 };
+	std::atomic<uint64_t> latency_total_us{ 0 };
+	std::atomic<uint64_t> latency_max_us{ 0 };
+
+};
@@ -0,0 +1,649 @@
+#include "chip8_capture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool lit(const uint64_t rows[32], int32_t x, int32_t y)
+{
+	return (rows[y] >> (63 - x)) & 1;
+}
+
+static void put_u16le(std::vector<uint8_t>& out, uint32_t v)
+{
+	out.push_back(v & 0xFF);
+	out.push_back((v >> 8) & 0xFF);
+}
+
+static void put_u32be(std::vector<uint8_t>& out, uint32_t v)
+{
+	out.push_back(v >> 24);
+	out.push_back((v >> 16) & 0xFF);
+	out.push_back((v >> 8) & 0xFF);
+	out.push_back(v & 0xFF);
+}
+
+y4m_video_sink::y4m_video_sink(const std::string& path, int32_t scale) : path(path), scale(std::max(scale, 1))
+{
+
+}
+
+y4m_video_sink::~y4m_video_sink()
+{
+	close();
+}
+
+bool y4m_video_sink::open()
+{
+	file = fopen(path.c_str(), "wb");
+
+	if (!file)
+		return false;
+
+	int32_t width = 64 * scale;
+	int32_t height = 32 * scale;
+
+	char header[128];
+	int32_t length = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", width, height);
+
+	fwrite(header, 1, length, file);
+	bytes_written += length;
+
+	// The chroma planes never change, only the luma is redrawn
+	const char* tag = "FRAME\n";
+
+	buffer.assign(6 + width * height + 2 * (width / 2) * (height / 2), 128);
+	memcpy(buffer.data(), tag, 6);
+
+	return true;
+}
+
+void y4m_video_sink::write(const uint64_t rows[32], uint32_t ticks)
+{
+	int32_t width = 64 * scale;
+	uint8_t* luma = buffer.data() + 6;
+
+	for (int32_t y = 0; y < 32; y++)
+	{
+		uint8_t* line = luma + y * scale * width;
+
+		// Lit pixels are black, as in the presenter
+		for (int32_t x = 0; x < 64; x++)
+			memset(line + x * scale, lit(rows, x, y) ? 0 : 255, scale);
+
+		for (int32_t r = 1; r < scale; r++)
+			memcpy(line + r * width, line, width);
+	}
+
+	for (uint32_t t = 0; t < ticks; t++)
+		fwrite(buffer.data(), 1, buffer.size(), file);
+
+	bytes_written += buffer.size() * ticks;
+}
+
+void y4m_video_sink::close()
+{
+	if (file)
+		fclose(file);
+
+	file = nullptr;
+}
+
+static uint32_t crc32(const uint8_t* data, size_t size)
+{
+	static uint32_t table[256];
+	static bool ready = false;
+
+	if (!ready)
+	{
+		for (uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+
+			for (int32_t k = 0; k < 8; k++)
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+
+			table[n] = c;
+		}
+
+		ready = true;
+	}
+
+	uint32_t c = 0xFFFFFFFFu;
+
+	for (size_t n = 0; n < size; n++)
+		c = table[(c ^ data[n]) & 0xFF] ^ (c >> 8);
+
+	return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t adler32(const uint8_t* data, size_t size)
+{
+	uint32_t a = 1, b = 0;
+
+	while (size > 0)
+	{
+		// Largest run that can't overflow b before the modulo
+		size_t run = std::min<size_t>(size, 5552);
+
+		for (size_t n = 0; n < run; n++)
+		{
+			a += data[n];
+			b += a;
+		}
+
+		a %= 65521;
+		b %= 65521;
+
+		data += run;
+		size -= run;
+	}
+
+	return (b << 16) | a;
+}
+
+// Appends a chunk, its type and data being the bytes from start on
+static void finish_png_chunk(std::vector<uint8_t>& out, size_t start)
+{
+	uint32_t length = uint32_t(out.size() - start - 4);
+
+	out[start - 4] = length >> 24;
+	out[start - 3] = (length >> 16) & 0xFF;
+	out[start - 2] = (length >> 8) & 0xFF;
+	out[start - 1] = length & 0xFF;
+
+	put_u32be(out, crc32(out.data() + start, out.size() - start));
+}
+
+static size_t begin_png_chunk(std::vector<uint8_t>& out, const char* type)
+{
+	put_u32be(out, 0); // length, filled in by finish_png_chunk()
+
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+
+	return start;
+}
+
+png_video_sink::png_video_sink(const std::string& path, int32_t scale) : scale(std::max(scale, 1))
+{
+	prefix = path;
+
+	if (prefix.size() > 4 && prefix.compare(prefix.size() - 4, 4, ".png") == 0)
+		prefix.resize(prefix.size() - 4);
+}
+
+png_video_sink::~png_video_sink()
+{
+	close();
+}
+
+bool png_video_sink::open()
+{
+	index = fopen((prefix + ".ffconcat").c_str(), "w");
+
+	if (!index)
+		return false;
+
+	fprintf(index, "ffconcat version 1.0\n");
+	return true;
+}
+
+void png_video_sink::write(const uint64_t rows[32], uint32_t ticks)
+{
+	int32_t width = 64 * scale;
+	int32_t height = 32 * scale;
+	int32_t stride = 1 + width / 8; // filter type, then the pixels
+
+	// 1-bit greyscale, 1 is white, so lit pixels are 0 bits
+	raw.assign(size_t(stride) * height, 0);
+
+	for (int32_t y = 0; y < 32; y++)
+	{
+		uint8_t* line = raw.data() + size_t(y) * scale * stride;
+
+		for (int32_t x = 0; x < width; x++)
+		{
+			if (!lit(rows, x / scale, y))
+				line[1 + (x >> 3)] |= 0x80 >> (x & 7);
+		}
+
+		for (int32_t r = 1; r < scale; r++)
+			memcpy(line + r * stride, line, stride);
+	}
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+	buffer.assign(signature, signature + 8);
+
+	size_t start = begin_png_chunk(buffer, "IHDR");
+	put_u32be(buffer, width);
+	put_u32be(buffer, height);
+	buffer.push_back(1); // bit depth
+	buffer.push_back(0); // greyscale
+	buffer.push_back(0); // deflate
+	buffer.push_back(0); // adaptive filtering
+	buffer.push_back(0); // not interlaced
+	finish_png_chunk(buffer, start);
+
+	// A zlib stream of stored blocks, at most 65535 bytes each
+	start = begin_png_chunk(buffer, "IDAT");
+	buffer.push_back(0x78);
+	buffer.push_back(0x01);
+
+	size_t offset = 0;
+
+	do
+	{
+		size_t length = std::min<size_t>(raw.size() - offset, 65535);
+
+		buffer.push_back(offset + length == raw.size() ? 1 : 0);
+		put_u16le(buffer, uint32_t(length));
+		put_u16le(buffer, uint32_t(~length & 0xFFFF));
+		buffer.insert(buffer.end(), raw.begin() + offset, raw.begin() + offset + length);
+
+		offset += length;
+	} while (offset < raw.size());
+
+	put_u32be(buffer, adler32(raw.data(), raw.size()));
+	finish_png_chunk(buffer, start);
+
+	start = begin_png_chunk(buffer, "IEND");
+	finish_png_chunk(buffer, start);
+
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "_%06d.png", count++);
+
+	std::string name = prefix + suffix;
+	FILE* file = fopen(name.c_str(), "wb");
+
+	if (file)
+	{
+		fwrite(buffer.data(), 1, buffer.size(), file);
+		fclose(file);
+		bytes_written += buffer.size();
+	}
+
+	// ffconcat resolves names relative to the index
+	size_t slash = name.find_last_of("/\\");
+	fprintf(index, "file '%s'\nduration %.6f\n", name.c_str() + (slash == std::string::npos ? 0 : slash + 1), ticks / 60.0);
+}
+
+void png_video_sink::close()
+{
+	if (index)
+		fclose(index);
+
+	index = nullptr;
+}
+
+gif_video_sink::gif_video_sink(const std::string& path, int32_t scale) : path(path), scale(std::max(scale, 1))
+{
+
+}
+
+gif_video_sink::~gif_video_sink()
+{
+	close();
+}
+
+bool gif_video_sink::open()
+{
+	file = fopen(path.c_str(), "wb");
+
+	if (!file)
+		return false;
+
+	buffer.clear();
+
+	const char* magic = "GIF89a";
+	buffer.insert(buffer.end(), magic, magic + 6);
+
+	put_u16le(buffer, 64 * scale);
+	put_u16le(buffer, 32 * scale);
+	buffer.push_back(0x80); // a global colour table of 2 entries
+	buffer.push_back(0); // background
+	buffer.push_back(0); // square pixels
+
+	// Index 1 is a lit pixel, black as in the presenter
+	static const uint8_t palette[6] = { 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00 };
+	buffer.insert(buffer.end(), palette, palette + 6);
+
+	// Loop forever
+	static const uint8_t loop[19] = { 0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00 };
+	buffer.insert(buffer.end(), loop, loop + 19);
+
+	fwrite(buffer.data(), 1, buffer.size(), file);
+	bytes_written += buffer.size();
+
+	return true;
+}
+
+void gif_video_sink::write(const uint64_t rows[32], uint32_t ticks)
+{
+	ticks_total += ticks;
+
+	int64_t delay = int64_t((ticks_total * 100 + 30) / 60 - delay_total);
+
+	if (delay < 2)
+	{
+		memcpy(held, rows, sizeof(held));
+		holding = true;
+		return;
+	}
+
+	encode(rows, int32_t(delay));
+	holding = false;
+}
+
+void gif_video_sink::close()
+{
+	if (!file)
+		return;
+
+	if (holding)
+	{
+		int64_t delay = int64_t((ticks_total * 100 + 30) / 60 - delay_total);
+		encode(held, int32_t(std::max<int64_t>(delay, 2)));
+		holding = false;
+	}
+
+	fputc(0x3B, file);
+	fclose(file);
+
+	bytes_written++;
+	file = nullptr;
+}
+
+void gif_video_sink::encode(const uint64_t rows[32], int32_t delay)
+{
+	// Bounds of what changed, everything for the first frame
+	int32_t top = 32, bottom = -1;
+	uint64_t columns = 0;
+
+	for (int32_t y = 0; y < 32; y++)
+	{
+		uint64_t diff = delay_total == 0 ? ~0ull : rows[y] ^ canvas[y];
+
+		if (diff)
+		{
+			top = std::min(top, y);
+			bottom = y;
+			columns |= diff;
+		}
+	}
+
+	int32_t left = 0, right = 0;
+
+	if (bottom < 0)
+	{
+		// Nothing to draw, but the time still has to pass: one unchanged pixel
+		top = bottom = 0;
+	}
+	else
+	{
+		while (!(columns & (1ull << (63 - left))))
+			left++;
+
+		right = 63;
+
+		while (!(columns & (1ull << (63 - right))))
+			right--;
+	}
+
+	int32_t width = (right - left + 1) * scale;
+	int32_t height = (bottom - top + 1) * scale;
+
+	pixels.resize(size_t(width) * height);
+
+	for (int32_t y = 0; y < height; y++)
+	{
+		for (int32_t x = 0; x < width; x++)
+			pixels[size_t(y) * width + x] = lit(rows, left + x / scale, top + y / scale) ? 1 : 0;
+	}
+
+	buffer.clear();
+
+	// Graphic control: leave this frame in place for the next, delay
+	buffer.push_back(0x21);
+	buffer.push_back(0xF9);
+	buffer.push_back(4);
+	buffer.push_back(1 << 2);
+	put_u16le(buffer, delay);
+	buffer.push_back(0);
+	buffer.push_back(0);
+
+	buffer.push_back(0x2C);
+	put_u16le(buffer, left * scale);
+	put_u16le(buffer, top * scale);
+	put_u16le(buffer, width);
+	put_u16le(buffer, height);
+	buffer.push_back(0);
+
+	lzw(pixels.data(), pixels.size());
+
+	fwrite(buffer.data(), 1, buffer.size(), file);
+	bytes_written += buffer.size();
+
+	memcpy(canvas, rows, sizeof(canvas));
+	delay_total += delay;
+}
+
+// GIF's variable width LZW, codes packed LSB first into sub-blocks of up
+// to 255 bytes. The decoder adds a table entry per code it reads, one
+// behind the encoder, and widens codes when its table reaches the next
+// power of two, so the encoder widens exactly when its own table does
+void gif_video_sink::lzw(const uint8_t* data, size_t count)
+{
+	const int32_t min_code_size = 2;
+	const int32_t clear = 1 << min_code_size;
+	const int32_t end = clear + 1;
+
+	table.assign(4096 << min_code_size, -1);
+
+	int32_t code_size = min_code_size + 1;
+	int32_t max_code = end;
+
+	std::vector<uint8_t> packed;
+	packed.reserve(count / 4 + 16);
+
+	uint32_t bits = 0;
+	int32_t bit_count = 0;
+
+	auto put = [&](int32_t code)
+	{
+		bits |= uint32_t(code) << bit_count;
+		bit_count += code_size;
+
+		while (bit_count >= 8)
+		{
+			packed.push_back(uint8_t(bits));
+			bits >>= 8;
+			bit_count -= 8;
+		}
+	};
+
+	put(clear);
+
+	int32_t current = data[0];
+
+	for (size_t k = 1; k < count; k++)
+	{
+		int16_t& next = table[(current << min_code_size) | data[k]];
+
+		if (next >= 0)
+		{
+			current = next;
+			continue;
+		}
+
+		put(current);
+		next = int16_t(++max_code);
+
+		if (max_code >= (1 << code_size) && code_size < 12)
+			code_size++;
+
+		if (max_code == 4095)
+		{
+			put(clear);
+			std::fill(table.begin(), table.end(), -1);
+
+			code_size = min_code_size + 1;
+			max_code = end;
+		}
+
+		current = data[k];
+	}
+
+	put(current);
+
+	// The decoder adds an entry for that last code as well
+	if (max_code + 1 >= (1 << code_size) && code_size < 12)
+		code_size++;
+
+	put(end);
+
+	if (bit_count > 0)
+		packed.push_back(uint8_t(bits));
+
+	buffer.push_back(min_code_size);
+
+	for (size_t offset = 0; offset < packed.size(); offset += 255)
+	{
+		size_t length = std::min<size_t>(packed.size() - offset, 255);
+
+		buffer.push_back(uint8_t(length));
+		buffer.insert(buffer.end(), packed.begin() + offset, packed.begin() + offset + length);
+	}
+
+	buffer.push_back(0);
+}
+
+chip8_capture::chip8_capture(size_t queue_frames) : ring(queue_frames)
+{
+
+}
+
+chip8_capture::~chip8_capture()
+{
+	stop();
+}
+
+bool chip8_capture::start(video_sink* new_sink, bool live)
+{
+	stop();
+
+	sink.reset(new_sink);
+
+	if (!sink->open())
+	{
+		sink.reset();
+		return false;
+	}
+
+	this->live = live;
+	has_pending = false;
+	dropped_ticks = 0;
+
+	running = true;
+	thread = std::thread(&chip8_capture::encode_thread, this);
+
+	return true;
+}
+
+void chip8_capture::stop()
+{
+	if (!sink)
+		return;
+
+	// Whatever was still collapsing goes in too, waiting if it has to
+	if (has_pending)
+		push(pending, true);
+
+	has_pending = false;
+
+	running = false;
+	thread.join();
+
+	sink->close();
+	bytes_written = sink->bytes_written;
+	sink.reset();
+}
+
+void chip8_capture::frame(const uint64_t rows[32], uint32_t ticks)
+{
+	if (!sink)
+		return;
+
+	frames += ticks;
+
+	if (has_pending && memcmp(pending.rows, rows, sizeof(pending.rows)) == 0)
+	{
+		pending.ticks += ticks;
+		return;
+	}
+
+	if (has_pending)
+		push(pending, !live);
+
+	memcpy(pending.rows, rows, sizeof(pending.rows));
+	pending.ticks = ticks;
+	has_pending = true;
+}
+
+void chip8_capture::push(const captured_frame& f, bool wait)
+{
+	captured_frame queued = f;
+	queued.ticks += dropped_ticks;
+
+	while (ring.write(&queued, 1) == 0)
+	{
+		// A dropped frame's time goes to the next one, so the recording
+		// keeps its length
+		if (!wait)
+		{
+			dropped_frames++;
+			dropped_ticks = queued.ticks;
+			return;
+		}
+
+		std::this_thread::yield();
+	}
+
+	dropped_ticks = 0;
+	distinct_frames++;
+	queue_high_water = std::max(queue_high_water, ring.size());
+}
+
+void chip8_capture::encode_thread()
+{
+	captured_frame f;
+
+	for (;;)
+	{
+		// Checked before reading, so everything queued before stop() is
+		// seen by the read
+		bool stopping = !running.load(std::memory_order_acquire);
+
+		if (ring.read(&f, 1) == 0)
+		{
+			if (stopping)
+				break;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		int64_t start = now_ns();
+		sink->write(f.rows, f.ticks);
+
+		encode_ns += now_ns() - start;
+		encoded_frames++;
+	}
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+#include "spsc_ring.h"
+
+// Where captured video ends up. Frames are the display at its native
+// 64x32, a row per word with bit 63 as column 0 (as in chip8::display),
+// and each lasts a whole number of 60 Hz ticks. Sinks scale them up by
+// an integer factor on the way out, called from the capture thread
+class video_sink
+{
+public:
+	virtual ~video_sink() = default;
+
+	virtual bool open() = 0;
+	virtual void write(const uint64_t rows[32], uint32_t ticks) = 0;
+
+	// Flushes and finishes the file(s), write() isn't called after this
+	virtual void close() {}
+
+	uint64_t bytes_written = 0;
+};
+
+// Raw 4:2:0 video at 60 fps. The format has no frame durations, so a
+// frame lasting several ticks is encoded once and written that often
+class y4m_video_sink : public video_sink
+{
+public:
+	y4m_video_sink(const std::string& path, int32_t scale);
+	~y4m_video_sink();
+
+	bool open() override;
+	void write(const uint64_t rows[32], uint32_t ticks) override;
+	void close() override;
+
+private:
+	std::string path;
+	int32_t scale;
+	FILE* file = nullptr;
+
+	std::vector<uint8_t> buffer; // one encoded frame, header included
+};
+
+// One 1-bit greyscale PNG per distinct frame, name_000000.png and so on
+// for name.png, plus name.ffconcat giving each one's duration. Pixel
+// data goes in stored (uncompressed) deflate blocks
+class png_video_sink : public video_sink
+{
+public:
+	png_video_sink(const std::string& path, int32_t scale);
+	~png_video_sink();
+
+	bool open() override;
+	void write(const uint64_t rows[32], uint32_t ticks) override;
+	void close() override;
+
+private:
+	std::string prefix;
+	int32_t scale;
+	FILE* index = nullptr;
+	int32_t count = 0;
+
+	std::vector<uint8_t> raw; // filtered scanlines
+	std::vector<uint8_t> buffer; // the whole file
+};
+
+// Animated GIF. Each frame only encodes the rectangle that changed since
+// the last one, on top of it. Delays are in centiseconds and players
+// stretch anything under 2 to 10, so a frame shorter than 20 ms is
+// folded into the one after it, keeping the total running time
+class gif_video_sink : public video_sink
+{
+public:
+	gif_video_sink(const std::string& path, int32_t scale);
+	~gif_video_sink();
+
+	bool open() override;
+	void write(const uint64_t rows[32], uint32_t ticks) override;
+	void close() override;
+
+private:
+	void encode(const uint64_t rows[32], int32_t delay);
+	void lzw(const uint8_t* pixels, size_t count);
+
+private:
+	std::string path;
+	int32_t scale;
+	FILE* file = nullptr;
+
+	uint64_t canvas[32]{}; // what the GIF shows after the last frame
+	uint64_t held[32]{}; // a frame too short to show on its own
+	bool holding = false;
+
+	uint64_t ticks_total = 0;
+	uint64_t delay_total = 0; // centiseconds written so far
+
+	std::vector<uint8_t> pixels;
+	std::vector<uint8_t> buffer;
+	std::vector<int16_t> table;
+};
+
+// Feeds a sink from a background thread so the core never waits on an
+// encoder or the disk. Identical consecutive frames are collapsed into
+// one longer frame before they're queued.
+class chip8_capture
+{
+public:
+	chip8_capture(size_t queue_frames = 256);
+	~chip8_capture();
+
+	// Takes ownership of sink. A live capture drops frames rather than
+	// wait when the queue is full, otherwise the core is held back to
+	// the encoder's pace and nothing is lost
+	bool start(video_sink* new_sink, bool live);
+	void stop();
+
+	bool active() const { return sink != nullptr; }
+	size_t queue_capacity() const { return ring.capacity(); }
+
+	// Producer side, the core's thread: the display after ticks frames
+	void frame(const uint64_t rows[32], uint32_t ticks = 1);
+
+public:
+	uint64_t frames = 0; // ticks captured
+	uint64_t distinct_frames = 0; // queued after collapsing
+	uint64_t dropped_frames = 0; // queue full on a live capture
+	size_t queue_high_water = 0;
+	uint64_t bytes_written = 0; // by the last sink, once stopped
+
+	std::atomic<uint64_t> encoded_frames{ 0 };
+	std::atomic<int64_t> encode_ns{ 0 };
+
+private:
+	struct captured_frame
+	{
+		uint64_t rows[32];
+		uint32_t ticks;
+	};
+
+	void push(const captured_frame& f, bool wait);
+	void encode_thread();
+
+private:
+	spsc_ring<captured_frame> ring;
+	std::unique_ptr<video_sink> sink;
+	bool live = false;
+
+	std::thread thread;
+	std::atomic<bool> running{ false };
+
+	// producer
+	captured_frame pending;
+	bool has_pending = false;
+	uint32_t dropped_ticks = 0; // added to the next frame that fits
+
+};
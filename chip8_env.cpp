@@ -0,0 +1,164 @@
+#include "chip8_env.h"
+#include "chip8_env_c.h"
+
+#include <algorithm>
+#include <cstring>
+
+chip8_env::chip8_env(int32_t count, int32_t threads) : initial(), pool(size_t(std::max(threads, 0)))
+{
+	for (int32_t n = 0; n < std::max(count, 1); n++)
+		instances.emplace_back(new chip8());
+}
+
+bool chip8_env::load_rom(const std::string& name)
+{
+	chip8& emu = *instances[0];
+
+	if (!emu.load_rom(name))
+		return false;
+
+	emu.cycles = 0;
+	emu.skipped_cycles = 0;
+	emu.save_state(initial);
+
+	// The rest only have what chip8() left them until they're reset too
+	reset(nullptr, nullptr, nullptr, nullptr);
+
+	return true;
+}
+
+void chip8_env::set_frame_skip(int32_t frames)
+{
+	frames_per_step = std::max(frames, 1);
+}
+
+bool chip8_env::set_ram_watch(const uint16_t* addresses, int32_t count)
+{
+	for (int32_t a = 0; a < count; a++)
+		if (addresses[a] >= sizeof(chip8::memory))
+			return false;
+
+	ram_watch.assign(addresses, addresses + std::max(count, 0));
+	return true;
+}
+
+void chip8_env::reset(const uint8_t* which, const uint32_t* seeds, uint64_t* screens, uint8_t* ram)
+{
+	pool.parallel_for(instances.size(), [&](size_t begin, size_t end)
+	{
+		for (size_t n = begin; n < end; n++)
+		{
+			chip8& emu = *instances[n];
+
+			if (!which || which[n])
+			{
+				emu.load_state(initial);
+
+				// Outside the state, and nothing should carry over
+				emu.key_snapshot.store(0, std::memory_order_relaxed);
+				emu.key_event_time = -1;
+				emu.key_responded = false;
+
+				if (seeds && seeds[n] != 0)
+					emu.rng = seeds[n];
+			}
+
+			observe(int32_t(n), screens, ram);
+		}
+	});
+}
+
+void chip8_env::step(const uint16_t* actions, uint64_t* screens, uint8_t* ram)
+{
+	int32_t frames = frames_per_step;
+
+	pool.parallel_for(instances.size(), [&](size_t begin, size_t end)
+	{
+		for (size_t n = begin; n < end; n++)
+		{
+			chip8& emu = *instances[n];
+
+			emu.set_keys(actions ? actions[n] : 0);
+			emu.run_frames(frames);
+
+			observe(int32_t(n), screens, ram);
+		}
+	});
+}
+
+void chip8_env::observe(int32_t n, uint64_t* screens, uint8_t* ram) const
+{
+	const chip8& emu = *instances[n];
+
+	if (screens)
+		memcpy(screens + size_t(n) * 32, emu.display, sizeof(emu.display));
+
+	if (ram)
+	{
+		uint8_t* out = ram + size_t(n) * ram_watch.size();
+
+		for (size_t a = 0; a < ram_watch.size(); a++)
+			out[a] = emu.memory[ram_watch[a]];
+	}
+}
+
+// C interface, nothing may throw past it
+
+chip8_env* chip8_env_create(const char* rom, int32_t count, int32_t threads)
+{
+	chip8_env* env = nullptr;
+
+	try
+	{
+		env = new chip8_env(count, threads);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+
+	if (!env->load_rom(rom))
+	{
+		delete env;
+		return nullptr;
+	}
+
+	return env;
+}
+
+void chip8_env_destroy(chip8_env* env)
+{
+	delete env;
+}
+
+int32_t chip8_env_size(const chip8_env* env)
+{
+	return env->size();
+}
+
+void chip8_env_set_frame_skip(chip8_env* env, int32_t frames)
+{
+	env->set_frame_skip(frames);
+}
+
+int32_t chip8_env_set_ram_watch(chip8_env* env, const uint16_t* addresses, int32_t count)
+{
+	try
+	{
+		return env->set_ram_watch(addresses, count) ? 1 : 0;
+	}
+	catch (...)
+	{
+		return 0;
+	}
+}
+
+void chip8_env_reset(chip8_env* env, const uint8_t* which, const uint32_t* seeds, uint64_t* screens, uint8_t* ram)
+{
+	env->reset(which, seeds, screens, ram);
+}
+
+void chip8_env_step(chip8_env* env, const uint16_t* actions, uint64_t* screens, uint8_t* ram)
+{
+	env->step(actions, screens, ram);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "chip8.h"
+#include "thread_pool.h"
+
+// A batch of independent cores running one ROM, for training agents.
+// step() holds each instance's keys for a number of frames and then
+// writes what every instance shows into arrays the caller owns:
+//
+//   screens  count * 32 words, the display of each instance in turn, a
+//            row per word with bit 63 as column 0 (as in chip8::display)
+//   ram      count * ram_watch_size() bytes, the watched memory addresses
+//            of each instance in turn, for rewards and episode ends
+//
+// Either may be null to skip it. Nothing is allocated once the ROM and
+// the watch list are set, and instances are stepped across a thread pool.
+class chip8_env
+{
+public:
+	// threads counts the caller, 0 uses every core
+	chip8_env(int32_t count, int32_t threads = 0);
+
+	// Restarts every instance from this ROM, and reset() goes back to it
+	bool load_rom(const std::string& name);
+
+	// Frames each step() runs with the same keys, at least 1
+	void set_frame_skip(int32_t frames);
+
+	// False (and the old list kept) if an address is out of range
+	bool set_ram_watch(const uint16_t* addresses, int32_t count);
+
+	int32_t size() const { return int32_t(instances.size()); }
+	int32_t frame_skip() const { return frames_per_step; }
+	int32_t ram_watch_size() const { return int32_t(ram_watch.size()); }
+
+	// Restarts the instances with a nonzero which[n], or all of them if
+	// which is null. seeds, if given, seed CXNN's generator (0 keeps the
+	// ROM's usual one). Observes every instance, reset or not
+	void reset(const uint8_t* which, const uint32_t* seeds, uint64_t* screens, uint8_t* ram);
+
+	// actions[n] is the keypad mask instance n holds, bit k for key k
+	void step(const uint16_t* actions, uint64_t* screens, uint8_t* ram);
+
+	chip8& instance(int32_t n) { return *instances[n]; }
+
+private:
+	void observe(int32_t n, uint64_t* screens, uint8_t* ram) const;
+
+private:
+	std::vector<std::unique_ptr<chip8>> instances;
+	chip8::state initial; // straight after the ROM loaded
+
+	int32_t frames_per_step = 4;
+	std::vector<uint16_t> ram_watch;
+
+	thread_pool pool;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+/* C interface to chip8_env, for loading it as a shared library from other
+ * runtimes. Build chip8.cpp and chip8_env.cpp into the library with
+ * CHIP8_ENV_BUILD defined. See chip8_env.h for the array layouts. */
+
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(CHIP8_ENV_BUILD)
+#define CHIP8_ENV_API __declspec(dllexport)
+#elif defined(_WIN32)
+#define CHIP8_ENV_API __declspec(dllimport)
+#elif defined(__GNUC__)
+#define CHIP8_ENV_API __attribute__((visibility("default")))
+#else
+#define CHIP8_ENV_API
+#endif
+
+#ifdef __cplusplus
+class chip8_env;
+extern "C" {
+#else
+typedef struct chip8_env chip8_env;
+#endif
+
+/* Null if the ROM can't be read. threads counts the caller, 0 uses every core */
+CHIP8_ENV_API chip8_env* chip8_env_create(const char* rom, int32_t count, int32_t threads);
+CHIP8_ENV_API void chip8_env_destroy(chip8_env* env);
+
+CHIP8_ENV_API int32_t chip8_env_size(const chip8_env* env);
+CHIP8_ENV_API void chip8_env_set_frame_skip(chip8_env* env, int32_t frames);
+
+/* 0 if an address is out of range */
+CHIP8_ENV_API int32_t chip8_env_set_ram_watch(chip8_env* env, const uint16_t* addresses, int32_t count);
+
+CHIP8_ENV_API void chip8_env_reset(chip8_env* env, const uint8_t* which, const uint32_t* seeds, uint64_t* screens, uint8_t* ram);
+CHIP8_ENV_API void chip8_env_step(chip8_env* env, const uint16_t* actions, uint64_t* screens, uint8_t* ram);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,229 @@
+#include "chip8_ram_search.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CHIP8_SSE2
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+static const size_t memory_size = 0xFFF; // sizeof(chip8::memory)
+
+static inline int32_t count_bits(uint64_t v)
+{
+#ifdef _MSC_VER
+	return (int32_t)__popcnt64(v);
+#else
+	return __builtin_popcountll(v);
+#endif
+}
+
+template <ram_compare op>
+static inline bool compare_byte(uint8_t cur, uint8_t ref, uint8_t n)
+{
+	switch (op)
+	{
+	case ram_compare::equal: return cur == ref;
+	case ram_compare::not_equal: return cur != ref;
+	case ram_compare::greater: return cur > ref;
+	case ram_compare::less: return cur < ref;
+	case ram_compare::greater_by: return cur == uint8_t(ref + n);
+	case ram_compare::less_by: return cur == uint8_t(ref - n);
+	}
+
+	return false;
+}
+
+#ifdef CHIP8_SSE2
+// Unsigned a > b is a saturating a - b that isn't zero
+template <ram_compare op>
+static inline uint32_t compare_16(const uint8_t* cur, const uint8_t* ref, __m128i n)
+{
+	__m128i c = _mm_loadu_si128((const __m128i*)cur);
+	__m128i r = _mm_loadu_si128((const __m128i*)ref);
+	__m128i zero = _mm_setzero_si128();
+
+	switch (op)
+	{
+	case ram_compare::equal: return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(c, r)));
+	case ram_compare::not_equal: return ~uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(c, r))) & 0xFFFF;
+	case ram_compare::greater: return ~uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(c, r), zero))) & 0xFFFF;
+	case ram_compare::less: return ~uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(r, c), zero))) & 0xFFFF;
+	case ram_compare::greater_by: return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_add_epi8(r, n))));
+	case ram_compare::less_by: return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_sub_epi8(r, n))));
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef __AVX2__
+template <ram_compare op>
+static inline uint32_t compare_32(const uint8_t* cur, const uint8_t* ref, __m256i n)
+{
+	__m256i c = _mm256_loadu_si256((const __m256i*)cur);
+	__m256i r = _mm256_loadu_si256((const __m256i*)ref);
+	__m256i zero = _mm256_setzero_si256();
+
+	switch (op)
+	{
+	case ram_compare::equal: return uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, r)));
+	case ram_compare::not_equal: return ~uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, r)));
+	case ram_compare::greater: return ~uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(c, r), zero)));
+	case ram_compare::less: return ~uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(r, c), zero)));
+	case ram_compare::greater_by: return uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_add_epi8(r, n))));
+	case ram_compare::less_by: return uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_sub_epi8(r, n))));
+	}
+
+	return 0;
+}
+#endif
+
+// The 64 addresses from cur (and ref) that compare, as a bitmap word
+template <ram_compare op>
+static inline uint64_t compare_block(const uint8_t* cur, const uint8_t* ref, uint8_t n)
+{
+#if defined(__AVX2__)
+	__m256i vn = _mm256_set1_epi8(char(n));
+
+	return uint64_t(compare_32<op>(cur, ref, vn)) | uint64_t(compare_32<op>(cur + 32, ref + 32, vn)) << 32;
+#elif defined(CHIP8_SSE2)
+	__m128i vn = _mm_set1_epi8(char(n));
+
+	return uint64_t(compare_16<op>(cur, ref, vn)) | uint64_t(compare_16<op>(cur + 16, ref + 16, vn)) << 16
+		| uint64_t(compare_16<op>(cur + 32, ref + 32, vn)) << 32 | uint64_t(compare_16<op>(cur + 48, ref + 48, vn)) << 48;
+#else
+	uint64_t mask = 0;
+
+	for (int32_t b = 0; b < 64; b++)
+		mask |= uint64_t(compare_byte<op>(cur[b], ref[b], n)) << b;
+
+	return mask;
+#endif
+}
+
+// The last word only has 63 addresses, and a lone memory copy ends there
+template <ram_compare op>
+static inline uint64_t compare_tail(const uint8_t* cur, const uint8_t* ref, uint8_t n)
+{
+	uint64_t mask = 0;
+
+	for (size_t b = 0; b < memory_size - 63 * 64; b++)
+		mask |= uint64_t(compare_byte<op>(cur[b], ref[b], n)) << b;
+
+	return mask;
+}
+
+// Word by word within a tile of snapshots small enough to stay in the
+// cache, so a word stops being read as soon as its last candidate drops
+// out without walking the whole series once per word
+template <ram_compare op>
+static void filter_words(uint64_t bits[64], const uint8_t* cur, size_t cur_stride, const uint8_t* ref, size_t ref_stride, size_t pairs, uint8_t n)
+{
+	const size_t tile = 32;
+
+	for (size_t first = 0; first < pairs; first += tile)
+	{
+		size_t last = std::min(first + tile, pairs);
+		uint64_t any = 0;
+
+		for (int32_t w = 0; w < 64; w++)
+		{
+			uint64_t mask = bits[w];
+			size_t offset = size_t(w) * 64;
+
+			for (size_t p = first; p < last && mask; p++)
+			{
+				const uint8_t* c = cur + p * cur_stride + offset;
+				const uint8_t* r = ref + p * ref_stride + offset;
+
+				mask &= w < 63 ? compare_block<op>(c, r, n) : compare_tail<op>(c, r, n);
+			}
+
+			bits[w] = mask;
+			any |= mask;
+		}
+
+		if (!any)
+			return;
+	}
+}
+
+chip8_ram_search::chip8_ram_search()
+{
+	reset();
+}
+
+void chip8_ram_search::reset()
+{
+	memset(bits, 0xFF, sizeof(bits));
+
+	// 0xFFF is past the end of memory
+	bits[63] &= ~(1ull << 63);
+}
+
+void chip8_ram_search::compare_value(const uint8_t* memory, ram_compare op, uint8_t value)
+{
+	compare_values(memory, 1, 0, op, value);
+}
+
+void chip8_ram_search::compare_values(const uint8_t* first, size_t count, size_t stride, ram_compare op, uint8_t value)
+{
+	memset(value_snapshot, value, sizeof(value_snapshot));
+
+	// The _by comparisons against a value are just equality with value
+	filter(first, stride, value_snapshot, 0, count, op, 0);
+}
+
+void chip8_ram_search::compare_change(const uint8_t* before, const uint8_t* after, ram_compare op, uint8_t n)
+{
+	filter(after, 0, before, 0, 1, op, n);
+}
+
+void chip8_ram_search::compare_series(const uint8_t* first, size_t count, size_t stride, ram_compare op, uint8_t n)
+{
+	if (count > 1)
+		filter(first + stride, stride, first, stride, count - 1, op, n);
+}
+
+void chip8_ram_search::filter(const uint8_t* cur, size_t cur_stride, const uint8_t* ref, size_t ref_stride, size_t pairs, ram_compare op, uint8_t n)
+{
+	switch (op)
+	{
+	case ram_compare::equal: filter_words<ram_compare::equal>(bits, cur, cur_stride, ref, ref_stride, pairs, n); break;
+	case ram_compare::not_equal: filter_words<ram_compare::not_equal>(bits, cur, cur_stride, ref, ref_stride, pairs, n); break;
+	case ram_compare::greater: filter_words<ram_compare::greater>(bits, cur, cur_stride, ref, ref_stride, pairs, n); break;
+	case ram_compare::less: filter_words<ram_compare::less>(bits, cur, cur_stride, ref, ref_stride, pairs, n); break;
+	case ram_compare::greater_by: filter_words<ram_compare::greater_by>(bits, cur, cur_stride, ref, ref_stride, pairs, n); break;
+	case ram_compare::less_by: filter_words<ram_compare::less_by>(bits, cur, cur_stride, ref, ref_stride, pairs, n); break;
+	}
+}
+
+size_t chip8_ram_search::count() const
+{
+	size_t total = 0;
+
+	for (int32_t w = 0; w < 64; w++)
+		total += count_bits(bits[w]);
+
+	return total;
+}
+
+bool chip8_ram_search::is_candidate(uint16_t address) const
+{
+	return address < memory_size && ((bits[address >> 6] >> (address & 63)) & 1);
+}
+
+void chip8_ram_search::candidates(std::vector<uint16_t>& out) const
+{
+	out.clear();
+
+	for (int32_t w = 0; w < 64; w++)
+		for (uint64_t mask = bits[w]; mask; mask &= mask - 1)
+			out.push_back(uint16_t(w * 64 + count_bits((mask & (0 - mask)) - 1)));
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// How a byte compares with its reference: a fixed value, or the same
+// address in an earlier snapshot. Comparisons are unsigned, the _by ones
+// wrap around like the ROM's own arithmetic
+enum class ram_compare
+{
+	equal, // unchanged
+	not_equal, // changed
+	greater, // increased
+	less, // decreased
+	greater_by, // exactly n more
+	less_by // exactly n less
+};
+
+// Narrows down where a ROM keeps something (lives, score, a position) by
+// filtering a candidate set of memory addresses against snapshots. The
+// candidates are a bitmap over the address space, compared 16 or 32
+// bytes at a time, and 64-address stretches with no candidates left are
+// skipped, so later filters over long series cost next to nothing.
+//
+// Snapshots are chip8::memory copies. A series is count of them stride
+// bytes apart, e.g. an array of chip8::state (memory is its first member).
+class chip8_ram_search
+{
+public:
+	chip8_ram_search();
+
+	// Every address a candidate again
+	void reset();
+
+	// Keeps the addresses where memory compares with value
+	void compare_value(const uint8_t* memory, ram_compare op, uint8_t value);
+
+	// ... in every snapshot of a series
+	void compare_values(const uint8_t* first, size_t count, size_t stride, ram_compare op, uint8_t value);
+
+	// Keeps the addresses where after compares with before
+	void compare_change(const uint8_t* before, const uint8_t* after, ram_compare op, uint8_t n = 0);
+
+	// ... from each snapshot of a series to the next
+	void compare_series(const uint8_t* first, size_t count, size_t stride, ram_compare op, uint8_t n = 0);
+
+	size_t count() const;
+	bool is_candidate(uint16_t address) const;
+	void candidates(std::vector<uint16_t>& out) const;
+
+	// Bit n of word w is address 64w + n
+	const uint64_t* bitmap() const { return bits; }
+
+private:
+	void filter(const uint8_t* cur, size_t cur_stride, const uint8_t* ref, size_t ref_stride, size_t pairs, ram_compare op, uint8_t n);
+
+private:
+	uint64_t bits[64];
+	uint8_t value_snapshot[4096]; // the reference for value comparisons
+
+};
@@ -0,0 +1,350 @@
+#include "chip8_search.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+static int64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t rotl(uint64_t v, int32_t r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+// MurmurHash3's finaliser
+static inline uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t hash_bytes(const void* data, size_t size, uint64_t seed)
+{
+	const uint8_t* p = static_cast<const uint8_t*>(data);
+	uint64_t h = seed * 0x9E3779B97F4A7C15ull;
+
+	for (; size >= 8; p += 8, size -= 8)
+	{
+		uint64_t word;
+		memcpy(&word, p, 8);
+		h = rotl(h ^ (word * 0x87C37B91114253D5ull), 31) * 0x4CF5AD432745937Full;
+	}
+
+	uint64_t tail = 0;
+	memcpy(&tail, p, size);
+
+	return mix(h ^ (tail * 0x87C37B91114253D5ull) ^ size);
+}
+
+chip8_search::chip8_search(const chip8_search_config& config) : config(config), pool(size_t(std::max(config.threads, 0))), result_state()
+{
+	if (this->config.inputs.empty())
+	{
+		this->config.inputs.push_back(0);
+
+		for (int32_t k = 0; k < 16; k++)
+			this->config.inputs.push_back(uint16_t(1 << k));
+	}
+
+	this->config.frames_per_input = std::max(this->config.frames_per_input, 1);
+	this->config.max_frontier = std::max(this->config.max_frontier, 1);
+}
+
+uint64_t chip8_search::hash_block(const uint8_t* memory, int32_t block)
+{
+	size_t from = size_t(block) * 64;
+	return hash_bytes(memory + from, std::min<size_t>(64, sizeof(chip8::state::memory) - from), uint64_t(block) + 1);
+}
+
+uint64_t chip8_search::hash_rest(const chip8::state& s)
+{
+	uint64_t h = hash_bytes(s.display, sizeof(s.display), 65);
+	h = hash_bytes(s.reg, sizeof(s.reg), h);
+	h = hash_bytes(s.stack, sizeof(s.stack[0]) * std::min<size_t>(s.sp, 16), h);
+
+	uint64_t scalars[3] =
+	{
+		uint64_t(s.i) | uint64_t(s.pc) << 16 | uint64_t(s.sp) << 32 | uint64_t(s.delay_timer) << 40
+			| uint64_t(s.sound_timer) << 48 | uint64_t(s.tone_on) << 56,
+		uint64_t(s.key_mask) | uint64_t(s.waiting_for_key) << 16 | uint64_t(s.waiting_for_key ? uint32_t(s.wait_reg) : 0) << 32,
+		s.rng
+	};
+
+	return hash_bytes(scalars, sizeof(scalars), h);
+}
+
+// Block hashes are summed, so changing one block is a subtract and an add
+uint64_t chip8_search::finish_hash(uint64_t memory_hash, uint64_t rest)
+{
+	return mix(memory_hash ^ rotl(rest, 17));
+}
+
+uint64_t chip8_search::hash_state(const chip8::state& s)
+{
+	uint64_t memory_hash = 0;
+
+	for (int32_t b = 0; b < 64; b++)
+		memory_hash += hash_block(s.memory, b);
+
+	return finish_hash(memory_hash, hash_rest(s));
+}
+
+bool chip8_search::insert_seen(uint64_t hash)
+{
+	if (hash == 0)
+		hash = 1;
+
+	// Kept at most half full
+	if ((seen_count + 1) * 2 > seen.size())
+	{
+		std::vector<uint64_t> old;
+		old.swap(seen);
+		seen.assign(std::max<size_t>(old.size() * 2, 1 << 16), 0);
+
+		size_t mask = seen.size() - 1;
+
+		for (uint64_t h : old)
+		{
+			if (h == 0)
+				continue;
+
+			size_t at = size_t(h) & mask;
+
+			while (seen[at] != 0)
+				at = (at + 1) & mask;
+
+			seen[at] = h;
+		}
+	}
+
+	size_t mask = seen.size() - 1;
+	size_t at = size_t(hash) & mask;
+
+	while (seen[at] != 0)
+	{
+		if (seen[at] == hash)
+			return false;
+
+		at = (at + 1) & mask;
+	}
+
+	seen[at] = hash;
+	seen_count++;
+	return true;
+}
+
+// The frontier's ordering: breadth-first takes nodes in the order they
+// were made, which is by depth
+bool chip8_search::lower_priority(uint32_t a, uint32_t b) const
+{
+	if (config.best_first && nodes[a].score != nodes[b].score)
+		return nodes[a].score < nodes[b].score;
+
+	return a > b;
+}
+
+void chip8_search::expand(uint32_t parent, chip8& emu, child* out, stored_state* out_states)
+{
+	const stored_state& from = stored[nodes[parent].slot];
+
+	for (size_t k = 0; k < config.inputs.size(); k++)
+	{
+		emu.load_state(from.state);
+
+		// The parent's input is still held, with no taps pending
+		emu.key_snapshot.store(from.state.key_mask, std::memory_order_relaxed);
+		emu.set_keys(config.inputs[k]);
+
+		emu.dirty_memory = 0;
+		emu.run_frames(config.frames_per_input);
+
+		stored_state& to = out_states[k];
+		emu.save_state(to.state);
+
+		uint64_t memory_hash = 0;
+
+		for (int32_t b = 0; b < 64; b++)
+		{
+			to.block_hash[b] = (emu.dirty_memory >> b) & 1 ? hash_block(to.state.memory, b) : from.block_hash[b];
+			memory_hash += to.block_hash[b];
+		}
+
+		child& c = out[k];
+		c.parent = parent;
+		c.input = config.inputs[k];
+		c.hash = finish_hash(memory_hash, hash_rest(to.state));
+		c.score = config.score ? config.score(to.state.memory) : 0.0;
+		c.goal = config.goal && config.goal(to.state.memory);
+	}
+}
+
+void chip8_search::record_result(uint32_t n, const chip8::state& s)
+{
+	result_state = s;
+	trace_path(n);
+}
+
+void chip8_search::trace_path(uint32_t n)
+{
+	result_path.clear();
+
+	for (; n != 0; n = nodes[n].parent)
+		result_path.push_back(nodes[n].input);
+
+	std::reverse(result_path.begin(), result_path.end());
+}
+
+bool chip8_search::run(const chip8::state& start)
+{
+	int64_t start_ns = now_ns();
+
+	expanded = generated = duplicates = pruned = 0;
+	max_depth_reached = 0;
+
+	nodes.clear();
+	stored.clear();
+	free_slots.clear();
+	frontier.clear();
+	seen.clear();
+	seen_count = 0;
+
+	stored.emplace_back();
+	stored[0].state = start;
+
+	for (int32_t b = 0; b < 64; b++)
+		stored[0].block_hash[b] = hash_block(start.memory, b);
+
+	nodes.push_back({ 0, 0, 0, config.score ? config.score(start.memory) : 0.0, 0 });
+	insert_seen(hash_state(start));
+
+	best_score = nodes[0].score;
+	record_result(0, start);
+
+	if (config.goal && config.goal(start.memory))
+	{
+		elapsed_ns = now_ns() - start_ns;
+		return true;
+	}
+
+	frontier.push_back(0);
+
+	auto heap_order = [this](uint32_t a, uint32_t b) { return lower_priority(a, b); };
+
+	size_t inputs = config.inputs.size();
+	size_t batch_size = pool.size() * 8;
+	bool found = false;
+
+	children.resize(batch_size * inputs);
+	child_states.resize(batch_size * inputs);
+
+	while (!frontier.empty() && !found && expanded < config.max_expanded)
+	{
+		// Take a round's worth of parents, leaves at the depth limit just
+		// give their slot back
+		batch.clear();
+
+		while (!frontier.empty() && batch.size() < batch_size && expanded + batch.size() < config.max_expanded)
+		{
+			std::pop_heap(frontier.begin(), frontier.end(), heap_order);
+			uint32_t n = frontier.back();
+			frontier.pop_back();
+
+			if (nodes[n].depth >= config.max_depth)
+			{
+				free_slots.push_back(nodes[n].slot);
+				nodes[n].slot = -1;
+				continue;
+			}
+
+			batch.push_back(n);
+		}
+
+		pool.parallel_for(batch.size(), [&](size_t begin, size_t end)
+		{
+			chip8 emu;
+
+			for (size_t p = begin; p < end; p++)
+				expand(batch[p], emu, &children[p * inputs], &child_states[p * inputs]);
+		});
+
+		expanded += batch.size();
+
+		for (uint32_t n : batch)
+		{
+			free_slots.push_back(nodes[n].slot);
+			nodes[n].slot = -1;
+		}
+
+		// Deduplicated in a fixed order, so the result doesn't depend on
+		// the thread count
+		for (size_t c = 0; c < batch.size() * inputs && !found; c++)
+		{
+			const child& ch = children[c];
+			generated++;
+
+			if (!insert_seen(ch.hash))
+			{
+				duplicates++;
+				continue;
+			}
+
+			uint32_t n = uint32_t(nodes.size());
+			uint16_t depth = uint16_t(nodes[ch.parent].depth + 1);
+
+			nodes.push_back({ ch.parent, ch.input, depth, ch.score, -1 });
+			max_depth_reached = std::max<int32_t>(max_depth_reached, depth);
+
+			if (ch.goal)
+			{
+				best_score = ch.score;
+				record_result(n, child_states[c].state);
+				found = true;
+				break;
+			}
+
+			if (ch.score > best_score)
+			{
+				best_score = ch.score;
+				record_result(n, child_states[c].state);
+			}
+
+			if (depth >= config.max_depth)
+				continue;
+
+			int32_t slot;
+
+			if (!free_slots.empty())
+			{
+				slot = free_slots.back();
+				free_slots.pop_back();
+			}
+			else if (int32_t(stored.size()) < config.max_frontier)
+			{
+				slot = int32_t(stored.size());
+				stored.emplace_back();
+			}
+			else
+			{
+				pruned++;
+				continue;
+			}
+
+			stored[slot] = child_states[c];
+			nodes[n].slot = slot;
+
+			frontier.push_back(n);
+			std::push_heap(frontier.begin(), frontier.end(), heap_order);
+		}
+	}
+
+	elapsed_ns = now_ns() - start_ns;
+	return found;
+}
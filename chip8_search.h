@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <functional>
+
+#include "chip8.h"
+#include "thread_pool.h"
+
+// Explores the tree of keypad inputs from a saved state, for tool-assisted
+// runs and automated testing. Every node is a machine state, its children
+// are that state after holding each of the inputs for frames_per_input
+// frames. States that hash alike are only expanded once, however they
+// were reached.
+struct chip8_search_config
+{
+	int32_t frames_per_input = 4;
+
+	// Keypad masks tried from every node, empty for no keys plus each key
+	std::vector<uint16_t> inputs;
+
+	int32_t max_depth = 64; // inputs in a path
+	uint64_t max_expanded = 1 << 20;
+
+	// States kept waiting to be expanded. Each is a whole chip8::state,
+	// so this is what bounds memory, children past it are pruned
+	int32_t max_frontier = 1 << 16;
+
+	// Breadth-first expands the shallowest nodes first, best-first the
+	// highest scoring
+	bool best_first = false;
+	int32_t threads = 0; // counts the caller, 0 uses every core
+
+	// Both are called on each new state's memory from the search threads
+	// at once. score orders best-first and picks the path reported when
+	// no goal is found, goal stops the search
+	std::function<double(const uint8_t* memory)> score;
+	std::function<bool(const uint8_t* memory)> goal;
+};
+
+class chip8_search
+{
+public:
+	chip8_search(const chip8_search_config& config);
+
+	// True if a goal was reached. Either way path() leads from start to
+	// the goal, or to the best scoring state seen, and end_state() is
+	// the state it leads to
+	bool run(const chip8::state& start);
+
+	const std::vector<uint16_t>& path() const { return result_path; }
+	const chip8::state& end_state() const { return result_state; }
+
+	// What two states have to share to count as the same: everything the
+	// ROM can observe, minus the clocks and the dead part of the stack
+	static uint64_t hash_state(const chip8::state& s);
+
+public:
+	uint64_t expanded = 0;
+	uint64_t generated = 0;
+	uint64_t duplicates = 0; // children whose state was already seen
+	uint64_t pruned = 0; // children dropped with the frontier full
+	int32_t max_depth_reached = 0;
+	double best_score = 0.0;
+	int64_t elapsed_ns = 0;
+
+private:
+	// A state plus the hash of each 64-byte block of its memory, so a
+	// child only rehashes the blocks its frames wrote
+	struct stored_state
+	{
+		chip8::state state;
+		uint64_t block_hash[64];
+	};
+
+	struct node
+	{
+		uint32_t parent;
+		uint16_t input;
+		uint16_t depth;
+		double score;
+		int32_t slot; // in stored, -1 once expanded or if it never was kept
+	};
+
+	// A child as the workers leave it, before it's deduplicated
+	struct child
+	{
+		uint32_t parent;
+		uint16_t input;
+		uint64_t hash;
+		double score;
+		bool goal;
+	};
+
+	static uint64_t hash_block(const uint8_t* memory, int32_t block);
+	static uint64_t hash_rest(const chip8::state& s);
+	static uint64_t finish_hash(uint64_t memory_hash, uint64_t rest);
+
+	void expand(uint32_t parent, chip8& emu, child* out, stored_state* out_states);
+	bool lower_priority(uint32_t a, uint32_t b) const;
+	bool insert_seen(uint64_t hash);
+	void record_result(uint32_t n, const chip8::state& s);
+	void trace_path(uint32_t n);
+
+private:
+	chip8_search_config config;
+	thread_pool pool;
+
+	std::vector<node> nodes;
+	std::vector<stored_state> stored;
+	std::vector<int32_t> free_slots;
+	std::vector<uint32_t> frontier; // a heap of node indices
+
+	std::vector<uint64_t> seen; // open-addressed set of state hashes, 0 is empty
+	uint64_t seen_count = 0;
+
+	// One round's parents and what the workers made of them, kept between
+	// rounds so they're only allocated once
+	std::vector<uint32_t> batch;
+	std::vector<child> children;
+	std::vector<stored_state> child_states;
+
+	std::vector<uint16_t> result_path;
+	chip8::state result_state;
+
+};
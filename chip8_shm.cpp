@@ -0,0 +1,332 @@
+#include "chip8_shm.h"
+
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char shm_magic[8] = { 'C', 'H', 'I', 'P', '8', 'S', 'H', 'M' };
+static const uint32_t shm_version = 1;
+
+#ifdef _WIN32
+static std::wstring mapping_name(const std::string& name)
+{
+	std::string base = name.size() > 0 && name[0] == '/' ? name.substr(1) : name;
+	return L"Local\\" + std::wstring(base.begin(), base.end());
+}
+#endif
+
+chip8_shm_export::~chip8_shm_export()
+{
+	close();
+}
+
+bool chip8_shm_export::open(const std::string& new_name, uint32_t slot_count)
+{
+	close();
+
+	if (slot_count < 2)
+		slot_count = 2;
+
+	size = sizeof(chip8_shm_header) + size_t(slot_count) * sizeof(chip8_shm_slot);
+	void* p = nullptr;
+
+#ifdef _WIN32
+	mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, DWORD(size), mapping_name(new_name).c_str());
+
+	if (!mapping)
+		return false;
+
+	p = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+
+	if (!p)
+	{
+		CloseHandle(mapping);
+		mapping = nullptr;
+		return false;
+	}
+
+	// An existing mapping of that name comes back as it was
+	memset(p, 0, size);
+#else
+	// Readers still attached to an old segment of this name keep it,
+	// anyone opening the name from now on gets the new one
+	shm_unlink(new_name.c_str());
+
+	int fd = shm_open(new_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+	if (fd < 0)
+		return false;
+
+	if (ftruncate(fd, off_t(size)) != 0)
+	{
+		::close(fd);
+		shm_unlink(new_name.c_str());
+		return false;
+	}
+
+	p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (p == MAP_FAILED)
+	{
+		shm_unlink(new_name.c_str());
+		return false;
+	}
+#endif
+
+	name = new_name;
+	header = static_cast<chip8_shm_header*>(p);
+	slots = reinterpret_cast<chip8_shm_slot*>(header + 1);
+	published = 0;
+
+	header->version = shm_version;
+	header->header_size = sizeof(chip8_shm_header);
+	header->slot_size = sizeof(chip8_shm_slot);
+	header->slot_count = slot_count;
+	header->width = 64;
+	header->height = 32;
+#ifdef _WIN32
+	header->pid = GetCurrentProcessId();
+#else
+	header->pid = uint32_t(getpid());
+#endif
+
+	// A reader that sees the magic sees everything above it too
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(header->magic, shm_magic, sizeof(shm_magic));
+
+	return true;
+}
+
+void chip8_shm_export::close()
+{
+	if (!header)
+		return;
+
+	header->closed.store(1, std::memory_order_release);
+
+#ifdef _WIN32
+	UnmapViewOfFile(header);
+	CloseHandle(mapping);
+	mapping = nullptr;
+#else
+	munmap(header, size);
+	shm_unlink(name.c_str());
+#endif
+
+	header = nullptr;
+	slots = nullptr;
+}
+
+void chip8_shm_export::publish(const chip8_shm_frame& f)
+{
+	if (!header)
+		return;
+
+	uint64_t n = published + 1;
+	chip8_shm_slot& s = slots[published % header->slot_count];
+
+	// The odd sequence has to be visible before any of the new fields
+	s.sequence.store(2 * n - 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	s.frame.store(f.frame, std::memory_order_relaxed);
+	s.cycles.store(f.cycles, std::memory_order_relaxed);
+	s.time_ns.store(f.time_ns, std::memory_order_relaxed);
+	s.ticks.store(f.ticks, std::memory_order_relaxed);
+	s.keys.store(f.keys, std::memory_order_relaxed);
+	s.flags.store(f.flags, std::memory_order_relaxed);
+
+	for (int32_t y = 0; y < 32; y++)
+		s.rows[y].store(f.rows[y], std::memory_order_relaxed);
+
+	s.sequence.store(2 * n, std::memory_order_release);
+	header->latest.store(n, std::memory_order_release);
+
+	published = n;
+}
+
+chip8_shm_reader::~chip8_shm_reader()
+{
+	close();
+}
+
+bool chip8_shm_reader::open(const std::string& name)
+{
+	close();
+
+	void* p = nullptr;
+
+#ifdef _WIN32
+	mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, mapping_name(name).c_str());
+
+	if (!mapping)
+		return false;
+
+	p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+	MEMORY_BASIC_INFORMATION info;
+
+	if (p && VirtualQuery(p, &info, sizeof(info)) == sizeof(info))
+		size = info.RegionSize;
+#else
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(chip8_shm_header))
+	{
+		size = size_t(st.st_size);
+		p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (p == MAP_FAILED)
+			p = nullptr;
+	}
+
+	::close(fd);
+#endif
+
+	if (!p)
+	{
+		close();
+		return false;
+	}
+
+	header = static_cast<chip8_shm_header*>(p);
+	slots = reinterpret_cast<chip8_shm_slot*>(header + 1);
+
+	// Refuse anything this build would misread, including a segment the
+	// emulator hasn't finished setting up yet
+	bool valid = size >= sizeof(chip8_shm_header) && memcmp(header->magic, shm_magic, sizeof(shm_magic)) == 0;
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	valid = valid && header->version == shm_version
+		&& header->header_size == sizeof(chip8_shm_header)
+		&& header->slot_size == sizeof(chip8_shm_slot)
+		&& header->slot_count > 0
+		&& size >= sizeof(chip8_shm_header) + size_t(header->slot_count) * sizeof(chip8_shm_slot);
+
+	if (!valid)
+	{
+		close();
+		return false;
+	}
+
+	torn_reads = 0;
+	return true;
+}
+
+void chip8_shm_reader::close()
+{
+	if (header)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(header);
+#else
+		munmap(header, size);
+#endif
+	}
+
+#ifdef _WIN32
+	if (mapping)
+		CloseHandle(mapping);
+
+	mapping = nullptr;
+#endif
+
+	header = nullptr;
+	slots = nullptr;
+	size = 0;
+}
+
+uint64_t chip8_shm_reader::latest() const
+{
+	return header ? header->latest.load(std::memory_order_acquire) : 0;
+}
+
+const chip8_shm_slot* chip8_shm_reader::begin_read(uint64_t n) const
+{
+	if (!header || n == 0)
+		return nullptr;
+
+	uint64_t newest = header->latest.load(std::memory_order_acquire);
+
+	if (n > newest || newest - n >= header->slot_count)
+		return nullptr;
+
+	const chip8_shm_slot* s = &slots[(n - 1) % header->slot_count];
+
+	// Anything but 2n means it's mid-write or already holds a later frame
+	if (s->sequence.load(std::memory_order_acquire) != 2 * n)
+		return nullptr;
+
+	return s;
+}
+
+bool chip8_shm_reader::end_read(const chip8_shm_slot* slot, uint64_t n)
+{
+	// The reads have to be finished before the sequence is checked again
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	if (slot->sequence.load(std::memory_order_relaxed) != 2 * n)
+	{
+		torn_reads++;
+		return false;
+	}
+
+	return true;
+}
+
+bool chip8_shm_reader::read(uint64_t n, chip8_shm_frame& f)
+{
+	const chip8_shm_slot* slot = begin_read(n);
+
+	if (!slot)
+		return false;
+
+	const chip8_shm_slot& s = *slot;
+
+	f.frame = s.frame.load(std::memory_order_relaxed);
+	f.cycles = s.cycles.load(std::memory_order_relaxed);
+	f.time_ns = s.time_ns.load(std::memory_order_relaxed);
+	f.ticks = s.ticks.load(std::memory_order_relaxed);
+	f.keys = s.keys.load(std::memory_order_relaxed);
+	f.flags = s.flags.load(std::memory_order_relaxed);
+
+	for (int32_t y = 0; y < 32; y++)
+		f.rows[y] = s.rows[y].load(std::memory_order_relaxed);
+
+	return end_read(slot, n);
+}
+
+bool chip8_shm_reader::read_latest(chip8_shm_frame& f, int32_t retries)
+{
+	if (!header)
+		return false;
+
+	for (int32_t i = 0; i <= retries; i++)
+	{
+		uint64_t n = header->latest.load(std::memory_order_acquire);
+
+		if (n == 0)
+			return false;
+
+		if (read(n, f))
+			return true;
+	}
+
+	return false;
+}
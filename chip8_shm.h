@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+
+// A named shared-memory ring of the core's frames, for viewers and
+// analysis tools in other processes. The emulator writes each frame into
+// the next slot under a per-slot seqlock and never waits for readers;
+// a reader copies a slot out (or looks at it in place) and checks the
+// sequence afterwards to know it wasn't overwritten meanwhile.
+//
+// POSIX shm_open() names start with '/', e.g. "/chip8-1". On Windows the
+// same name is a Local\ file mapping.
+
+// Slots start on a cache line, so writing one never touches a line
+// another slot's readers are on
+struct alignas(64) chip8_shm_slot
+{
+	// Odd while the emulator is writing, 2 * n once the nth published
+	// frame is complete. The other fields only mean something when read
+	// between two equal, even loads of it
+	std::atomic<uint64_t> sequence;
+
+	std::atomic<uint64_t> frame; // emulated frames since the ROM started, this one included
+	std::atomic<uint64_t> cycles;
+	std::atomic<int64_t> time_ns; // steady clock when it was published
+	std::atomic<uint32_t> ticks; // frames this covers, more than 1 when the core skipped idle ones
+	std::atomic<uint16_t> keys; // keypad as the core saw it
+	std::atomic<uint16_t> flags; // shm_flag_*
+
+	// The display, a row per word with bit 63 as column 0
+	std::atomic<uint64_t> rows[32];
+};
+
+struct alignas(64) chip8_shm_header
+{
+	char magic[8]; // "CHIP8SHM"
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t slot_size;
+	uint32_t slot_count;
+	uint32_t width;
+	uint32_t height;
+	uint32_t pid;
+	uint32_t reserved;
+
+	// Frames published so far, the nth (from 1) is in slot
+	// (n - 1) % slot_count
+	std::atomic<uint64_t> latest;
+	std::atomic<uint32_t> closed; // the emulator has gone
+};
+
+const uint16_t shm_flag_sound = 1; // buzzer on
+const uint16_t shm_flag_waiting = 2; // stopped at FX0A for a key
+
+// The view a reader gets of one frame
+struct chip8_shm_frame
+{
+	uint64_t frame;
+	uint64_t cycles;
+	int64_t time_ns;
+	uint32_t ticks;
+	uint16_t keys;
+	uint16_t flags;
+	uint64_t rows[32];
+};
+
+// Writer side, owned by the thread running the core
+class chip8_shm_export
+{
+public:
+	~chip8_shm_export();
+
+	// Creates (or replaces) the segment
+	bool open(const std::string& name, uint32_t slot_count = 8);
+
+	// Marks the segment closed and removes the name, readers that already
+	// have it mapped keep what they have
+	void close();
+
+	bool active() const { return header != nullptr; }
+
+	void publish(const chip8_shm_frame& f);
+
+public:
+	uint64_t published = 0;
+
+private:
+	std::string name;
+	chip8_shm_header* header = nullptr;
+	chip8_shm_slot* slots = nullptr;
+	size_t size = 0;
+
+#ifdef _WIN32
+	void* mapping = nullptr;
+#endif
+};
+
+// Reader side, for other processes
+class chip8_shm_reader
+{
+public:
+	~chip8_shm_reader();
+
+	bool open(const std::string& name);
+	void close();
+
+	const chip8_shm_header* get_header() const { return header; }
+
+	// Copies out the newest complete frame. False if there's none yet or
+	// the emulator kept overwriting it for all of the retries
+	bool read_latest(chip8_shm_frame& f, int32_t retries = 4);
+
+	// Copies out the nth published frame if it's still in the ring
+	bool read(uint64_t n, chip8_shm_frame& f);
+
+	// The same without the copy. begin_read() returns the slot holding
+	// the nth frame, or null if it's gone or mid-write. Load what's needed
+	// straight from it, then end_read() says whether all of that was the
+	// nth frame and not a later one overwriting it, in which case throw
+	// it away. Frames are numbered from 1, latest() is the newest
+	uint64_t latest() const;
+	const chip8_shm_slot* begin_read(uint64_t n) const;
+	bool end_read(const chip8_shm_slot* slot, uint64_t n);
+
+public:
+	uint64_t torn_reads = 0; // reads the seqlock rejected
+
+private:
+	chip8_shm_header* header = nullptr;
+	chip8_shm_slot* slots = nullptr;
+	size_t size = 0;
+
+#ifdef _WIN32
+	void* mapping = nullptr;
+#endif
+};
@@ -0,0 +1,134 @@
+// Watches emulators started with --shm name from another process, one
+// status line per instance and, with --show, the first one's display.
+// Never slows the emulators down, whatever it does.
+//
+// Usage: shm_viewer [--show] [--interval ms] name [name ...]
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+
+#include "chip8_shm.h"
+
+struct instance
+{
+	std::string name;
+	chip8_shm_reader reader;
+	bool attached = false;
+
+	chip8_shm_frame last{};
+	bool has_last = false;
+};
+
+static void show_display(const uint64_t rows[32])
+{
+	// Two display rows per line of half blocks
+	for (int32_t y = 0; y < 32; y += 2)
+	{
+		std::string line;
+
+		for (int32_t x = 0; x < 64; x++)
+		{
+			bool top = (rows[y] >> (63 - x)) & 1;
+			bool bottom = (rows[y + 1] >> (63 - x)) & 1;
+
+			line += top ? (bottom ? "\xE2\x96\x88" : "\xE2\x96\x80") : (bottom ? "\xE2\x96\x84" : " ");
+		}
+
+		std::cout << line << '\n';
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	bool show = false;
+	int32_t interval_ms = 250;
+	std::vector<std::unique_ptr<instance>> instances;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--show") == 0)
+			show = true;
+		else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc)
+			interval_ms = std::max(std::stoi(argv[++i]), 1);
+		else
+		{
+			instances.emplace_back(new instance());
+			instances.back()->name = argv[i];
+		}
+	}
+
+	if (instances.empty())
+	{
+		std::cerr << "usage: shm_viewer [--show] [--interval ms] name [name ...]\n";
+		return 1;
+	}
+
+	bool running = true;
+
+	while (running)
+	{
+		running = false;
+
+		if (show)
+			std::cout << "\x1b[H\x1b[2J";
+
+		for (size_t i = 0; i < instances.size(); i++)
+		{
+			instance& in = *instances[i];
+
+			if (!in.attached)
+				in.attached = in.reader.open(in.name);
+
+			if (!in.attached)
+			{
+				std::cout << in.name << ": waiting\n";
+				running = true;
+				continue;
+			}
+
+			const chip8_shm_header* header = in.reader.get_header();
+			bool closed = header->closed.load(std::memory_order_acquire) != 0;
+
+			chip8_shm_frame f;
+
+			if (!in.reader.read_latest(f))
+			{
+				std::cout << in.name << ": pid " << header->pid << (closed ? ", closed\n" : ", no frames yet\n");
+				running = running || !closed;
+				continue;
+			}
+
+			// Emulated frames per second of host time since the last look
+			float rate = 0.0f;
+
+			if (in.has_last && f.time_ns > in.last.time_ns)
+				rate = (f.frame - in.last.frame) * 1e9f / (f.time_ns - in.last.time_ns);
+
+			std::cout << in.name << ": pid " << header->pid << ", frame " << f.frame << ", cycles " << f.cycles
+				<< ", " << rate << " frames/s, keys " << std::hex << f.keys << std::dec
+				<< ((f.flags & shm_flag_sound) ? ", sound" : "") << ((f.flags & shm_flag_waiting) ? ", waiting for key" : "")
+				<< ", " << in.reader.torn_reads << " torn reads" << (closed ? ", closed" : "") << '\n';
+
+			if (show && i == 0)
+				show_display(f.rows);
+
+			in.last = f;
+			in.has_last = true;
+
+			running = running || !closed;
+		}
+
+		std::cout.flush();
+
+		if (running)
+			std::this_thread::sleep_for(std::chrono::milliseconds(interval_ms));
+	}
+
+	return 0;
+}
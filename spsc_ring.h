@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Single-producer single-consumer ring of trivially copyable values.
+// Capacity is rounded up to a power of two, positions run freely and are
+// masked on access so a full ring needs no spare slot.
+template <typename T>
+class spsc_ring
+{
+public:
+	explicit spsc_ring(size_t min_capacity)
+	{
+		size_t capacity = 1;
+
+		while (capacity < min_capacity)
+			capacity <<= 1;
+
+		data.resize(capacity);
+		mask = capacity - 1;
+	}
+
+	size_t capacity() const
+	{
+		return data.size();
+	}
+
+	// Either side may call these, the answer is a lower bound for the
+	// caller's own operation
+	size_t size() const
+	{
+		return size_t(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+	}
+
+	size_t space() const
+	{
+		return capacity() - size();
+	}
+
+	// Producer side, returns how many values fit
+	size_t write(const T* values, size_t count)
+	{
+		uint64_t t = tail.load(std::memory_order_relaxed);
+		uint64_t h = head.load(std::memory_order_acquire);
+
+		size_t n = std::min(count, capacity() - size_t(t - h));
+		copy_in(size_t(t & mask), values, n);
+
+		tail.store(t + n, std::memory_order_release);
+		return n;
+	}
+
+	// Consumer side, returns how many values were available
+	size_t read(T* values, size_t count)
+	{
+		uint64_t h = head.load(std::memory_order_relaxed);
+		uint64_t t = tail.load(std::memory_order_acquire);
+
+		size_t n = std::min(count, size_t(t - h));
+		copy_out(size_t(h & mask), values, n);
+
+		head.store(h + n, std::memory_order_release);
+		return n;
+	}
+
+	// Total values ever read, i.e. the position of the next one
+	uint64_t read_position() const
+	{
+		return head.load(std::memory_order_acquire);
+	}
+
+private:
+	void copy_in(size_t at, const T* values, size_t n)
+	{
+		size_t first = std::min(n, data.size() - at);
+
+		memcpy(&data[at], values, first * sizeof(T));
+		memcpy(&data[0], values + first, (n - first) * sizeof(T));
+	}
+
+	void copy_out(size_t at, T* values, size_t n) const
+	{
+		size_t first = std::min(n, data.size() - at);
+
+		memcpy(values, &data[at], first * sizeof(T));
+		memcpy(values + first, &data[0], (n - first) * sizeof(T));
+	}
+
+private:
+	std::vector<T> data;
+	size_t mask;
+
+	alignas(64) std::atomic<uint64_t> head{ 0 };
+	alignas(64) std::atomic<uint64_t> tail{ 0 };
+
+};
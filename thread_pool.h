@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// A fixed set of worker threads for splitting a loop across cores. The
+// calling thread works too, so a pool of 1 runs everything inline, and
+// nothing is allocated per parallel_for() call.
+class thread_pool
+{
+public:
+	// 0 uses every core. Counts the caller, so threads - 1 are started
+	explicit thread_pool(size_t threads = 0)
+	{
+		if (threads == 0)
+			threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+		for (size_t t = 1; t < threads; t++)
+			workers.emplace_back(&thread_pool::worker, this);
+	}
+
+	~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+
+		start_cond.notify_all();
+
+		for (std::thread& t : workers)
+			t.join();
+	}
+
+	size_t size() const
+	{
+		return workers.size() + 1;
+	}
+
+	// Calls fn(begin, end) over chunks of [0, count) and returns once all
+	// of them are done. Chunks are handed out as threads come free, so
+	// uneven work still balances. Not reentrant
+	template <typename F>
+	void parallel_for(size_t count, F&& fn)
+	{
+		if (workers.empty() || count < 2)
+		{
+			if (count > 0)
+				fn(size_t(0), count);
+
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			job = [](void* context, size_t begin, size_t end) { (*static_cast<typename std::remove_reference<F>::type*>(context))(begin, end); };
+			job_context = const_cast<void*>(static_cast<const void*>(&fn));
+			job_count = count;
+			job_chunk = std::max<size_t>(count / (size() * 4), 1);
+			next.store(0, std::memory_order_relaxed);
+
+			busy = workers.size();
+			generation++;
+		}
+
+		start_cond.notify_all();
+		run_chunks();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cond.wait(lock, [this] { return busy == 0; });
+	}
+
+private:
+	void worker()
+	{
+		uint64_t seen = 0;
+
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_cond.wait(lock, [&] { return stopping || generation != seen; });
+
+				if (stopping)
+					return;
+
+				seen = generation;
+			}
+
+			run_chunks();
+
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (--busy == 0)
+				done_cond.notify_one();
+		}
+	}
+
+	void run_chunks()
+	{
+		while (true)
+		{
+			size_t begin = next.fetch_add(job_chunk, std::memory_order_relaxed);
+
+			if (begin >= job_count)
+				return;
+
+			job(job_context, begin, std::min(begin + job_chunk, job_count));
+		}
+	}
+
+private:
+	std::vector<std::thread> workers;
+
+	std::mutex mutex;
+	std::condition_variable start_cond;
+	std::condition_variable done_cond;
+	uint64_t generation = 0;
+	size_t busy = 0; // workers still on the current job
+	bool stopping = false;
+
+	// The current job, set under the mutex before generation moves on
+	void (*job)(void* context, size_t begin, size_t end) = nullptr;
+	void* job_context = nullptr;
+	size_t job_count = 0;
+	size_t job_chunk = 1;
+	std::atomic<size_t> next{ 0 };
+
+};
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Single-producer single-consumer triple buffer. The writer fills
+// write_buffer() and publishes it, the reader acquires and then reads
+// read_buffer(), which always holds the newest complete frame. The
+// writer never waits for the reader, the reader can sleep until the
+// writer next publishes instead of polling.
+template <typename T>
+class triple_buffer
+{
+public:
+	// Writer side
+
+	T& write_buffer()
+	{
+		return slots[back];
+	}
+
+	// Hands the write buffer to the reader, returns true if the frame it
+	// replaces was never acquired (a dropped frame)
+	bool publish()
+	{
+		uint8_t prev = middle.exchange(uint8_t(back | fresh_bit), std::memory_order_acq_rel);
+		back = prev & index_mask;
+
+		published.fetch_add(1, std::memory_order_relaxed);
+
+		// Only so the notify can't slip in between wait_for_publish()
+		// checking and sleeping, publishing itself never blocks on it
+		{
+			std::lock_guard<std::mutex> lock(wait_mutex);
+		}
+
+		wait_cond.notify_one();
+
+		if (prev & fresh_bit)
+		{
+			dropped.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		return false;
+	}
+
+	// Reader side
+
+	// Sleeps until there's a frame acquire() would take or timeout has
+	// passed, returns true in the first case
+	template <typename Rep, typename Period>
+	bool wait_for_publish(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		std::unique_lock<std::mutex> lock(wait_mutex);
+
+		return wait_cond.wait_for(lock, timeout, [this] { return (middle.load(std::memory_order_acquire) & fresh_bit) != 0; });
+	}
+
+	// Swaps in the newest published frame, returns false and keeps the
+	// current one if nothing was published since the last call. Meant to
+	// be called once per presented frame, so a false is a frame shown twice
+	bool acquire()
+	{
+		// Only publish() sets the bit and only we clear it, so it can't
+		// go away between the load and the exchange
+		if (!(middle.load(std::memory_order_relaxed) & fresh_bit))
+		{
+			duplicated++;
+			return false;
+		}
+
+		uint8_t prev = middle.exchange(front, std::memory_order_acq_rel);
+		front = prev & index_mask;
+
+		acquired++;
+		return true;
+	}
+
+	const T& read_buffer() const
+	{
+		return slots[front];
+	}
+
+public:
+	std::atomic<uint64_t> published{ 0 };
+	std::atomic<uint64_t> dropped{ 0 }; // overwritten before being acquired
+
+	uint64_t acquired = 0;
+	uint64_t duplicated = 0; // acquire() calls that found nothing new, frames shown twice
+
+private:
+	static const uint8_t index_mask = 0x3;
+	static const uint8_t fresh_bit = 0x4;
+
+	T slots[3];
+
+	// Each index is owned by one side, keep them off each other's cache line
+	alignas(64) uint8_t back = 2;
+	alignas(64) std::atomic<uint8_t> middle{ 1 };
+	alignas(64) uint8_t front = 0;
+
+	std::mutex wait_mutex;
+	std::condition_variable wait_cond;
+
+};